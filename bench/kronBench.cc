@@ -0,0 +1,292 @@
+// -*- lsst-c++ -*-
+/*
+ * LSST Data Management System
+ * Copyright 2008-2015 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+/*
+ * Time the hot paths of Kron photometry on fields of synthetic galaxies
+ *
+ * Usage:
+ *    kronBench [minTime]
+ *
+ * Each benchmark is repeated until it's taken at least minTime seconds (default 0.5), and reports the
+ * number of sources and pixels processed per second.  The benchmarks are:
+ *    psfRadius       The PSF's shape at each source (the work done by calculatePsfKronRadius)
+ *    fluxNaive       Photometry in a fixed aperture, summing the pixels (KronFluxControl.fixed = true)
+ *    fluxSinc        Photometry in a fixed aperture, using sinc apertures
+ *    measure         KronFluxAlgorithm::measure; i.e. KronAperture::determine followed by photometry
+ *    measureCatalog  KronFluxAlgorithm::measureCatalog
+ * for a range of galaxy sizes and axis ratios, with and without smoothing and for several values of
+ * nIterForRadius.  The "pixels" are (approximately) the pixels in the apertures used to estimate the Kron
+ * radius (at most nIterForRadius times) and the flux.
+ *
+ * The galaxies are elliptical Gaussians, as made by makeGalaxy in tests/Kron.py (but without subsampling)
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <sys/time.h>
+
+#include "lsst/afw/geom.h"
+#include "lsst/afw/geom/ellipses.h"
+#include "lsst/afw/image.h"
+#include "lsst/afw/detection/GaussianPsf.h"
+#include "lsst/afw/table/Source.h"
+#include "lsst/meas/base/CentroidUtilities.h"
+#include "lsst/meas/base/ShapeUtilities.h"
+#include "lsst/meas/extensions/photometryKron.h"
+
+namespace afwGeom = lsst::afw::geom;
+namespace afwImage = lsst::afw::image;
+namespace afwTable = lsst::afw::table;
+namespace measBase = lsst::meas::base;
+namespace kron = lsst::meas::extensions::photometryKron;
+
+namespace {
+
+double const NSIGMA_FOR_RADIUS = 6.0;   // KronFluxControl.nSigmaForRadius
+int const NX = 10, NY = 10;             // number of galaxies in each row and column of the field
+
+/*
+ * Return the wall-clock time, in seconds
+ */
+double getTime() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+/*
+ * Add an elliptical Gaussian galaxy to an image
+ */
+void addGalaxy(afwImage::Image<float> & image,
+               double const flux,                // total flux
+               afwGeom::ellipses::Axes const& axes, // shape of galaxy; a, b are the standard deviations
+               afwGeom::Point2D const& center      // centre of galaxy
+              ) {
+    double const a = axes.getA(), b = axes.getB();
+    double const c = std::cos(axes.getTheta()), s = std::sin(axes.getTheta());
+    double const I0 = flux/(2*afwGeom::PI*a*b);
+    int const r = static_cast<int>(std::ceil(10*a));
+
+    int const xc = static_cast<int>(center.getX() + 0.5), yc = static_cast<int>(center.getY() + 0.5);
+    int const x0 = std::max(xc - r, image.getX0()), x1 = std::min(xc + r, image.getX0() + image.getWidth() - 1);
+    int const y0 = std::max(yc - r, image.getY0()), y1 = std::min(yc + r, image.getY0() + image.getHeight() - 1);
+    for (int y = y0; y <= y1; ++y) {
+        afwImage::Image<float>::x_iterator ptr = image.row_begin(y - image.getY0()) + (x0 - image.getX0());
+        for (int x = x0; x <= x1; ++x, ++ptr) {
+            double const dx = x - center.getX(), dy = y - center.getY();
+            double const u =  c*dx + s*dy;
+            double const v = -s*dx + c*dy;
+            *ptr += I0*std::exp(-0.5*((u/a)*(u/a) + (v/b)*(v/b)));
+        }
+    }
+}
+
+/*
+ * A field of galaxies, and a catalog of their true positions and shapes
+ */
+class Field {
+public:
+    Field(double const sigma,           // rms size of the galaxies' major axes
+          double const axisRatio        // b/a for the galaxies
+         ) : _spacing(static_cast<int>(2*std::ceil(NSIGMA_FOR_RADIUS*sigma + 10))),
+             _exposure(afwGeom::Extent2I(NX*_spacing, NY*_spacing)),
+             _schema(afwTable::SourceTable::makeMinimalSchema())
+    {
+        afwImage::MaskedImage<float> & mimage = _exposure.getMaskedImage();
+        *mimage.getImage() = 0.0;
+        *mimage.getMask() = 0x0;
+        *mimage.getVariance() = 1.0;
+        _exposure.setPsf(boost::make_shared<lsst::afw::detection::GaussianPsf>(21, 21, 1.5));
+
+        _centroidKey = measBase::CentroidResultKey::addFields(_schema, "truth_centroid", "true centroid",
+                                                              measBase::NO_UNCERTAINTY);
+        _schema.addField<afwTable::Flag>("truth_centroid_flag", "centroid failed (never set)");
+        _shapeKey = measBase::ShapeResultKey::addFields(_schema, "truth_shape", "true shape",
+                                                        measBase::NO_UNCERTAINTY);
+        _schema.addField<afwTable::Flag>("truth_shape_flag", "shape failed (never set)");
+        _schema.getAliasMap()->set("slot_Centroid", "truth_centroid");
+        _schema.getAliasMap()->set("slot_Shape", "truth_shape");
+
+        _axes = afwGeom::ellipses::Axes(sigma, axisRatio*sigma, 0.5);
+        for (int iy = 0; iy != NY; ++iy) {
+            for (int ix = 0; ix != NX; ++ix) {
+                // offset the centres from the pixel grid by different amounts
+                _centers.push_back(afwGeom::Point2D((ix + 0.5)*_spacing + 0.1*ix/NX,
+                                                    (iy + 0.5)*_spacing + 0.1*iy/NY));
+                addGalaxy(*mimage.getImage(), 1e4, _axes, _centers.back());
+            }
+        }
+    }
+
+    afwImage::Exposure<float> const& getExposure() const { return _exposure; }
+    std::vector<afwGeom::Point2D> const& getCenters() const { return _centers; }
+
+    /// Return the number of pixels in the apertures used to estimate the radius (if !fixed) and flux
+    double getPixelsPerSource(kron::KronFluxControl const& ctrl) const {
+        double const nRadius2 = ctrl.nRadiusForFlux*ctrl.nRadiusForFlux +
+            (ctrl.fixed ? 0.0 : ctrl.nIterForRadius*ctrl.nSigmaForRadius*ctrl.nSigmaForRadius);
+        return afwGeom::PI*_axes.getA()*_axes.getB()*nRadius2;
+    }
+
+    /// Return a catalog of the galaxies; schema must be a copy of getSchema() with any extra fields added
+    afwTable::SourceCatalog makeCatalog(afwTable::Schema const& schema) const {
+        afwGeom::ellipses::Quadrupole const quad(_axes);
+        afwTable::SourceCatalog catalog(schema);
+        for (std::size_t i = 0; i != _centers.size(); ++i) {
+            PTR(afwTable::SourceRecord) source = catalog.addNew();
+            measBase::CentroidResult centroid;
+            centroid.x = _centers[i].getX();
+            centroid.y = _centers[i].getY();
+            source->set(_centroidKey, centroid);
+            measBase::ShapeResult shape;
+            shape.xx = quad.getIxx();
+            shape.yy = quad.getIyy();
+            shape.xy = quad.getIxy();
+            source->set(_shapeKey, shape);
+        }
+        return catalog;
+    }
+
+    /// Return a copy of the schema used for catalogs of the galaxies
+    afwTable::Schema getSchema() const { return afwTable::Schema(_schema); }
+
+private:
+    int const _spacing;                 // spacing of the galaxies
+    afwImage::Exposure<float> _exposure;
+    afwTable::Schema _schema;
+    measBase::CentroidResultKey _centroidKey;
+    measBase::ShapeResultKey _shapeKey;
+    afwGeom::ellipses::Axes _axes;      // the galaxies' shape
+    std::vector<afwGeom::Point2D> _centers; // the galaxies' centres
+};
+
+/*
+ * Report the speed of one benchmark
+ */
+void report(char const* name, double const sigma, double const axisRatio, double const smoothingSigma,
+            int const nIterForRadius, int const nSource, double const pixelsPerSource, double const time) {
+    printf("%-15s sigma=%4.1f b/a=%3.1f smooth=%-3s nIter=%d   %10.0f sources/s  %12.0f pixels/s\n",
+           name, sigma, axisRatio, (smoothingSigma > 0 ? "yes" : "no"), nIterForRadius,
+           nSource/time, nSource*pixelsPerSource/time);
+}
+
+/*
+ * Time KronFluxAlgorithm::measure (or measureCatalog) on a field
+ */
+void timeMeasure(char const* name, Field const& field, kron::KronFluxControl const& ctrl,
+                 bool const useMeasureCatalog, double const minTime,
+                 double const sigma, double const axisRatio) {
+    afwTable::Schema schema = field.getSchema();
+    kron::KronFluxAlgorithm algorithm(ctrl, "ext_photometryKron_KronFlux", schema);
+    afwTable::SourceCatalog catalog = field.makeCatalog(schema);
+
+    int nSource = 0;
+    double const t0 = getTime();
+    double time = 0;
+    do {
+        if (useMeasureCatalog) {
+            algorithm.measureCatalog(catalog, field.getExposure());
+        } else {
+            for (afwTable::SourceCatalog::iterator source = catalog.begin(); source != catalog.end();
+                 ++source) {
+                try {
+                    algorithm.measure(*source, field.getExposure());
+                } catch (measBase::MeasurementError & e) {
+                    algorithm.fail(*source, &e);
+                }
+            }
+        }
+        nSource += catalog.size();
+        time = getTime() - t0;
+    } while (time < minTime);
+
+    report(name, sigma, axisRatio, ctrl.smoothingSigma, ctrl.nIterForRadius, nSource,
+           field.getPixelsPerSource(ctrl), time);
+}
+
+/*
+ * Time evaluating the PSF's shape at each source (the work done by calculatePsfKronRadius)
+ */
+void timePsfRadius(Field const& field, double const minTime, double const sigma, double const axisRatio) {
+    CONST_PTR(lsst::afw::detection::Psf) psf = field.getExposure().getPsf();
+    std::vector<afwGeom::Point2D> const& centers = field.getCenters();
+
+    int nSource = 0;
+    double sum = 0;                     // stop the compiler optimising the calls away
+    double const t0 = getTime();
+    double time = 0;
+    do {
+        for (std::size_t i = 0; i != centers.size(); ++i) {
+            sum += psf->computeShape(centers[i]).getDeterminantRadius();
+        }
+        nSource += centers.size();
+        time = getTime() - t0;
+    } while (time < minTime);
+
+    report("psfRadius", sigma, axisRatio, -1, 0, nSource, 0.0, time);
+    if (sum < 0) {
+        printf("(impossible) %g\n", sum);
+    }
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    double const minTime = (argc > 1) ? std::atof(argv[1]) : 0.5;
+
+    double const sigmas[] = {1.5, 3.0, 8.0};
+    double const axisRatios[] = {1.0, 0.4};
+    double const smoothingSigmas[] = {-1.0, 1.0};
+    int const nIterForRadii[] = {1, 3};
+
+    for (std::size_t is = 0; is != sizeof(sigmas)/sizeof(sigmas[0]); ++is) {
+        for (std::size_t iq = 0; iq != sizeof(axisRatios)/sizeof(axisRatios[0]); ++iq) {
+            double const sigma = sigmas[is], axisRatio = axisRatios[iq];
+            Field const field(sigma, axisRatio);
+
+            timePsfRadius(field, minTime, sigma, axisRatio);
+
+            kron::KronFluxControl ctrl;
+            ctrl.nSigmaForRadius = NSIGMA_FOR_RADIUS;
+            ctrl.fixed = true;
+            ctrl.maxSincRadius = 0;     // never use sinc apertures
+            timeMeasure("fluxNaive", field, ctrl, false, minTime, sigma, axisRatio);
+            ctrl.maxSincRadius = 1e6;   // always use sinc apertures
+            timeMeasure("fluxSinc", field, ctrl, false, minTime, sigma, axisRatio);
+
+            ctrl = kron::KronFluxControl();
+            ctrl.nSigmaForRadius = NSIGMA_FOR_RADIUS;
+            for (std::size_t ism = 0; ism != sizeof(smoothingSigmas)/sizeof(smoothingSigmas[0]); ++ism) {
+                for (std::size_t ini = 0; ini != sizeof(nIterForRadii)/sizeof(nIterForRadii[0]); ++ini) {
+                    ctrl.smoothingSigma = smoothingSigmas[ism];
+                    ctrl.nIterForRadius = nIterForRadii[ini];
+                    timeMeasure("measure", field, ctrl, false, minTime, sigma, axisRatio);
+                    timeMeasure("measureCatalog", field, ctrl, true, minTime, sigma, axisRatio);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
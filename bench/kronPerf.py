@@ -0,0 +1,258 @@
+#!/usr/bin/env python
+#
+# LSST Data Management System
+# Copyright 2008-2015 LSST Corporation.
+#
+# This product includes software developed by the
+# LSST Project (http://www.lsst.org/).
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the LSST License Statement and
+# the GNU General Public License along with this program.  If not,
+# see <http://www.lsstcorp.org/LegalNotices/>.
+#
+"""
+End-to-end performance regression check of ext_photometryKron_KronFlux
+
+Run with:
+   python bench/kronPerf.py --record kronPerf.json     # record a baseline
+   python bench/kronPerf.py kronPerf.json              # compare with it
+
+The plugin is run in a SingleFrameMeasurementTask and a ForcedMeasurementTask on fixed sparse and crowded
+fields of synthetic galaxies (as made by makeGalaxy in tests/Kron.py, but only rendered near each galaxy).
+Each source is then measured again on its own to give per-source latency percentiles, and the process's
+peak RSS is reported.  When comparing, the run fails if any flux or radius differs from the baseline by
+more than the tolerances used by tests/Kron.py (getTolFlux and getTolRad), if any flag differs, or if the
+median latency has grown by more than --maxSlowdown.
+"""
+import argparse
+import json
+import math
+import os
+import resource
+import sys
+import time
+
+import numpy as np
+import lsst.afw.coord as afwCoord
+import lsst.afw.detection as afwDetection
+import lsst.afw.geom as afwGeom
+import lsst.afw.geom.ellipses as afwEllipses
+import lsst.afw.image as afwImage
+import lsst.afw.table as afwTable
+import lsst.meas.base as measBase
+import lsst.meas.extensions.photometryKron
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), os.path.pardir, "tests"))
+import Kron
+
+PREFIX = "ext_photometryKron_KronFlux"
+KFAC = 2.5                              # nRadiusForFlux used for all the measurements
+
+# name: (width, height, number of galaxies)
+FIELDS = [("sparse", 1024, 1024, 40),
+          ("crowded", 512, 512, 200),
+          ]
+
+def addGalaxy(exposure, flux, a, b, theta, xcen, ycen):
+    """Add an elliptical Gaussian galaxy to exposure, with the same profile as tests/Kron.py's makeGalaxy
+    (including its subsampling within 10.5 pixels of the centre) but only evaluated within 8 sigma"""
+    image = exposure.getMaskedImage().getImage()
+    array = image.getArray()
+    I0 = flux/(2*math.pi*a*b)
+    c, s = math.cos(math.radians(theta)), math.sin(math.radians(theta))
+
+    half = int(math.ceil(8*max(a, b)))
+    x0, y0 = max(int(xcen) - half, 0), max(int(ycen) - half, 0)
+    x1, y1 = min(int(xcen) + half + 1, image.getWidth()), min(int(ycen) + half + 1, image.getHeight())
+    y, x = np.mgrid[y0:y1, x0:x1]
+    dx, dy = x - xcen, y - ycen
+
+    nsample = 5
+    subZ = np.linspace(-0.5*(1 - 1.0/nsample), 0.5*(1 - 1.0/nsample), nsample)
+    inner = np.hypot(dx, dy) < 10.5
+    val = np.zeros(dx.shape)
+    for sx in subZ:
+        for sy in subZ:
+            u = c*(dx + sx) + s*(dy + sy)
+            v = -s*(dx + sx) + c*(dy + sy)
+            val += np.exp(-0.5*((u/a)**2 + (v/b)**2))
+    val /= nsample**2
+    u, v = c*dx + s*dy, -s*dx + c*dy
+    val = np.where(inner, val, np.exp(-0.5*((u/a)**2 + (v/b)**2)))
+
+    array[y0:y1, x0:x1] += I0*val
+
+def makeField(width, height, nGalaxy, seed=12345):
+    """Make a reproducible field of nGalaxy random galaxies"""
+    rand = np.random.RandomState(seed)
+    # The same Wcs, Psf and variance as tests/Kron.py's makeGalaxy
+    exposure = afwImage.makeExposure(afwImage.makeMaskedImage(afwImage.ImageF(width, height)))
+    exposure.getMaskedImage().getVariance().set(1.0)
+    exposure.setWcs(afwImage.makeWcs(afwCoord.Coord(0.0*afwGeom.degrees, 0.0*afwGeom.degrees),
+                                     afwGeom.Point2D(0.0, 0.0), 1.0e-4, 0.0, 0.0, 1.0e-4))
+    exposure.setPsf(afwDetection.GaussianPsf(11, 11, 0.01))
+    for i in range(nGalaxy):
+        a = rand.uniform(1.0, 5.0)
+        b = a*rand.uniform(0.3, 1.0)
+        addGalaxy(exposure, 10**rand.uniform(3.5, 5), a, b, rand.uniform(0, 180),
+                  rand.uniform(0, width - 1), rand.uniform(0, height - 1))
+    return exposure
+
+def percentiles(times):
+    """Return the 50th, 90th and 99th percentiles of times (in microseconds)"""
+    return dict(zip(("p50", "p90", "p99"), [1e6*float(p) for p in np.percentile(times, [50, 90, 99])]))
+
+def timeSources(catalog, measureOne, nRepeat):
+    """Return the time taken by measureOne(i) for each source i in catalog (the best of nRepeat)"""
+    times = []
+    for i in range(len(catalog)):
+        best = None
+        for j in range(nRepeat):
+            t0 = time.time()
+            measureOne(i)
+            dt = time.time() - t0
+            best = dt if best is None else min(best, dt)
+        times.append(best)
+    return times
+
+def getOutputs(catalog):
+    """Return the Kron outputs of each source in catalog, with the axes used to set tolerances"""
+    outputs = []
+    for source in catalog:
+        try:
+            axes = afwEllipses.Axes(source.getShape())
+            a, b = axes.getA(), axes.getB()
+        except Exception:
+            a, b = float("nan"), float("nan")
+        outputs.append(dict(flux=source.get(PREFIX + "_flux"), radius=source.get(PREFIX + "_radius"),
+                            flag=bool(source.get(PREFIX + "_flag")), a=a, b=b))
+    return outputs
+
+def single(catalog, i):
+    """Return a catalog containing just catalog[i] (which is shared, not copied)"""
+    one = afwTable.SourceCatalog(catalog.getTable())
+    one.append(catalog[i])
+    return one
+
+def runField(name, width, height, nGalaxy, nRepeat):
+    """Measure a field in single-frame and forced mode, returning the outputs and timings"""
+    exposure = makeField(width, height, nGalaxy)
+    results = {}
+    #
+    # Single-frame measurement
+    #
+    t0 = time.time()
+    msConfig = Kron.makeMeasurementConfig(nIterForRadius=2, kfac=KFAC)
+    refCat, task = Kron.measureFreeCatalog(exposure, msConfig)
+    taskTime = time.time() - t0
+    algorithm = task.plugins[PREFIX].cpp
+
+    singleCats = [single(refCat, i) for i in range(len(refCat))]
+    times = timeSources(refCat, lambda i: algorithm.measureCatalog(singleCats[i], exposure), nRepeat)
+    results["single"] = dict(sources=getOutputs(refCat), taskTime=taskTime, **percentiles(times))
+    #
+    # Forced measurement, using the single-frame results as the reference
+    #
+    refWcs = exposure.getWcs()
+    msConfig = Kron.makeMeasurementConfig(forced=True, kfac=KFAC)
+    schema = afwTable.SourceTable.makeMinimalSchema()
+    task = measBase.ForcedMeasurementTask(schema, config=msConfig)
+    measCat = task.generateMeasCat(exposure, refCat, refWcs)
+    task.attachTransformedFootprints(measCat, refCat, exposure, refWcs)
+    t0 = time.time()
+    task.run(measCat, exposure, refCat, refWcs)
+    taskTime = time.time() - t0
+    algorithm = task.plugins[PREFIX].cpp
+
+    forcedCats = [(single(measCat, i), single(refCat, i)) for i in range(len(measCat))]
+    times = timeSources(measCat, lambda i: algorithm.measureForcedCatalog(forcedCats[i][0], exposure,
+                                                                          forcedCats[i][1], refWcs),
+                        nRepeat)
+    results["forced"] = dict(sources=getOutputs(measCat), taskTime=taskTime, **percentiles(times))
+
+    return results
+
+def compare(name, mode, result, baseline, maxSlowdown):
+    """Compare a result with its baseline, returning a list of the problems found"""
+    problems = []
+    tolFlux = Kron.KronPhotometryTestCase.getTolFlux.im_func
+    tolRad = Kron.KronPhotometryTestCase.getTolRad.im_func
+
+    sources, refSources = result["sources"], baseline["sources"]
+    if len(sources) != len(refSources):
+        return ["%s %s: %d sources v. %d in the baseline" % (name, mode, len(sources), len(refSources))]
+    for i, (source, ref) in enumerate(zip(sources, refSources)):
+        where = "%s %s source %d" % (name, mode, i)
+        if source["flag"] != ref["flag"]:
+            problems.append("%s: flag %s v. %s" % (where, source["flag"], ref["flag"]))
+            continue
+        if ref["flag"] or not (ref["flux"] > 0) or np.isnan(ref["a"]):
+            continue
+        dFlux = 100*abs(source["flux"]/ref["flux"] - 1) # percent
+        if not (dFlux <= tolFlux(None, ref["a"], ref["b"], KFAC)):
+            problems.append("%s: flux %g v. %g (%.3f%%)" % (where, source["flux"], ref["flux"], dFlux))
+        dRadius = 100*abs(source["radius"] - ref["radius"]) # hundredths of a pixel
+        if not (dRadius <= tolRad(None, ref["a"], ref["b"])):
+            problems.append("%s: radius %g v. %g" % (where, source["radius"], ref["radius"]))
+
+    if result["p50"] > (1 + maxSlowdown)*baseline["p50"]:
+        problems.append("%s %s: median latency %.1fus v. %.1fus in the baseline" %
+                        (name, mode, result["p50"], baseline["p50"]))
+    return problems
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0].strip())
+    parser.add_argument("baseline", help="file of baseline results (JSON)")
+    parser.add_argument("--record", action="store_true", default=False,
+                        help="write the results to baseline, rather than comparing with it")
+    parser.add_argument("--maxSlowdown", type=float, default=0.2,
+                        help="largest acceptable fractional increase in the median per-source latency")
+    parser.add_argument("--nRepeat", type=int, default=3,
+                        help="number of times to measure each source (the fastest is used)")
+    args = parser.parse_args()
+
+    results = {}
+    for name, width, height, nGalaxy in FIELDS:
+        results[name] = runField(name, width, height, nGalaxy, args.nRepeat)
+        for mode in ("single", "forced"):
+            result = results[name][mode]
+            print "%-8s %-7s %4d sources  task %6.2fs  latency p50 %8.1fus p90 %8.1fus p99 %8.1fus" % \
+                (name, mode, len(result["sources"]), result["taskTime"],
+                 result["p50"], result["p90"], result["p99"])
+    peakRss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss/1024.0 # ru_maxrss is in kB on linux
+    print "peak RSS %.1f MB" % peakRss
+
+    if args.record:
+        with open(args.baseline, "w") as fd:
+            json.dump(dict(fields=results, peakRss=peakRss), fd, indent=1, sort_keys=True)
+        print "Wrote baseline to %s" % args.baseline
+        return 0
+
+    with open(args.baseline) as fd:
+        baseline = json.load(fd)
+    problems = []
+    for name, width, height, nGalaxy in FIELDS:
+        for mode in ("single", "forced"):
+            if name not in baseline["fields"]:
+                problems.append("%s isn't in the baseline; re-record it" % name)
+                break
+            problems += compare(name, mode, results[name][mode], baseline["fields"][name][mode],
+                                args.maxSlowdown)
+    for problem in problems:
+        print "FAIL:", problem
+    print "%s (baseline %s; peak RSS then %.1f MB)" % ("FAILED" if problems else "OK", args.baseline,
+                                                     baseline["peakRss"])
+    return 1 if problems else 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -23,8 +23,14 @@
 #ifndef LSST_MEAS_EXTENSIONS_PHOTOMETRY_KRON_H
 #define LSST_MEAS_EXTENSIONS_PHOTOMETRY_KRON_H
 
+#include <vector>
+
+#include "boost/noncopyable.hpp"
+#include "ndarray.h"
 #include "lsst/pex/config.h"
 #include "lsst/afw/image/Exposure.h"
+#include "lsst/afw/detection/Footprint.h"
+#include "lsst/afw/geom/ellipses/Ellipse.h"
 #include "lsst/meas/base/Algorithm.h"
 #include "lsst/meas/base/FluxUtilities.h"
 #include "lsst/meas/base/CentroidUtilities.h"
@@ -34,6 +40,12 @@
 namespace lsst { namespace meas { namespace extensions { namespace photometryKron {
 
 struct KronAperture;
+class PsfKronRadiusCache;
+class WcsPairCache;
+class ReferenceKeyCache;
+class SincCoeffsCache;
+class KronFluxStatsCollector;
+class DeferredSources;
 
 /**
  *  @brief C++ control object for Kron flux.
@@ -48,9 +60,28 @@ public:
     LSST_CONTROL_FIELD(nSigmaForRadius, double,
                        "Multiplier of rms size for aperture used to initially estimate the Kron radius");
     LSST_CONTROL_FIELD(nIterForRadius, int, "Number of times to iterate when setting the Kron radius");
+    LSST_CONTROL_FIELD(radiusTolerance, double,
+                       "Stop iterating when the fractional change in the Kron radius falls below this; "
+                       "if 0 always iterate nIterForRadius times (unless the radius stops growing)");
+    LSST_CONTROL_FIELD(incrementalRadius, bool,
+                       "When iterating for the Kron radius, only sum the annulus between the previous and "
+                       "new apertures (the results differ from re-summing the whole aperture by round-off)");
+    LSST_CONTROL_FIELD(floatRadiusMoments, bool,
+                       "Accumulate the moments used to estimate the Kron radius in single precision within "
+                       "short blocks of pixels, and in double precision across blocks.  Faster, with a "
+                       "relative error in <r> of at most ~1e-6*sum(|I|)/sum(I)");
     LSST_CONTROL_FIELD(nRadiusForFlux, double, "Number of Kron radii for Kron flux");
+    LSST_CONTROL_FIELD(extraNRadiusForFlux, std::vector<double>,
+                       "Additional numbers of Kron radii for which to measure fluxes, in fields "
+                       "<name>_<n>_flux with n formatted as %.1f with . replaced by _ (e.g. 3_5); "
+                       "all the apertures are measured in a single pass over the pixels.  The values must "
+                       "give distinct names, and not include nRadiusForFlux");
     LSST_CONTROL_FIELD(maxSincRadius, double,
                        "Largest aperture for which to use the slow, accurate, sinc aperture code");
+    LSST_CONTROL_FIELD(badMaskPlanes, std::vector<std::string>,
+                       "Skip the pixels with any of these mask planes set while estimating the Kron radius "
+                       "and summing fluxes (but not in sinc apertures, which use all the pixels), and "
+                       "report the fraction of the Kron aperture that's masked; if empty use all pixels");
     LSST_CONTROL_FIELD(minimumRadius, double,
                        "Minimum Kron radius (if == 0.0 use PSF's Kron radius) if enforceMinimumRadius. "
                        "Also functions as fallback aperture radius if set.");
@@ -59,20 +90,157 @@ public:
                        "Use the Footprint size as part of initial estimate of Kron radius");
     LSST_CONTROL_FIELD(smoothingSigma, double,
                        "Smooth image with N(0, smoothingSigma^2) Gaussian while estimating R_K");
+    LSST_CONTROL_FIELD(psfRadiusGridSpacing, int,
+                       "If > 0, evaluate the PSF's Kron radius on a grid spanning the image with at most "
+                       "this spacing (pixels) and interpolate, rather than evaluating it at the position "
+                       "of every source");
+    LSST_CONTROL_FIELD(cacheSmoothedImage, bool,
+                       "If smoothing, measureCatalog smooths the whole image once (lazily, in tiles) and "
+                       "shares it between sources, rather than smoothing each source's region");
+    LSST_CONTROL_FIELD(smoothingTileSize, int,
+                       "Size of tiles (pixels) used if cacheSmoothedImage; if <= 0 use a single tile");
+    LSST_CONTROL_FIELD(smoothingTileBudget, int,
+                       "Maximum number of smoothed tiles to hold in memory if cacheSmoothedImage; "
+                       "if <= 0 there's no limit");
+    LSST_CONTROL_FIELD(sincCacheTolerance, double,
+                       "If > 0, cache sinc aperture coefficients for shapes quantized with this fractional "
+                       "tolerance in a and b (and about this many radians in theta), rather than "
+                       "calculating them for every source");
+    LSST_CONTROL_FIELD(sincCacheMaxMemory, double,
+                       "Maximum memory (MB) to use for cached sinc coefficients; if <= 0 there's no limit");
+    LSST_CONTROL_FIELD(collectStats, bool,
+                       "Collect timings and counts of the work done; see KronFluxAlgorithm::getStats()");
+    LSST_CONTROL_FIELD(nThreads, int,
+                       "Number of threads to use in measureCatalog; if <= 0 use one per hardware thread");
 
     KronFluxControl() :
         fixed(false),
         nSigmaForRadius(6.0),
         nIterForRadius(1),
+        radiusTolerance(0.0),
+        incrementalRadius(false),
+        floatRadiusMoments(false),
         nRadiusForFlux(2.5),
+        extraNRadiusForFlux(),
         maxSincRadius(10.0),
+        badMaskPlanes(),
         minimumRadius(0.0),
         enforceMinimumRadius(true),
         useFootprintRadius(false),
-        smoothingSigma(-1.0)
+        smoothingSigma(-1.0),
+        psfRadiusGridSpacing(0),
+        cacheSmoothedImage(false),
+        smoothingTileSize(256),
+        smoothingTileBudget(64),
+        sincCacheTolerance(0.0),
+        sincCacheMaxMemory(64),
+        collectStats(false),
+        nThreads(1)
     {}
 };
 
+/**
+ *  @brief Statistics of the use of the cache of sinc aperture coefficients
+ *
+ *  @sa KronFluxControl::sincCacheTolerance
+ */
+struct SincCacheStats {
+    SincCacheStats() : nHit(0), nMiss(0), nEntry(0), nBytes(0) {}
+
+    long nHit;                          ///< number of apertures whose coefficients were in the cache
+    long nMiss;                         ///< number of apertures whose coefficients had to be calculated
+    long nEntry;                        ///< number of sets of coefficients currently in the cache
+    double nBytes;                      ///< memory used by the coefficients currently in the cache
+};
+
+/**
+ *  @brief Timings and counts of the work done by a KronFluxAlgorithm
+ *
+ *  Only collected if KronFluxControl.collectStats is true.  Each thread gathers its own statistics, which
+ *  are added to the algorithm's totals when it's finished; times are wall-clock seconds, summed over
+ *  threads.
+ */
+struct KronFluxStats {
+    KronFluxStats() : nSource(0), nIter(0), nSinc(0), nNaive(0), nFallback(0), nEdge(0),
+                      psfTime(0.0), smoothingTime(0.0), radiusTime(0.0), sincTime(0.0), naiveTime(0.0) {}
+
+    KronFluxStats & operator+=(KronFluxStats const& rhs) {
+        nSource += rhs.nSource;
+        nIter += rhs.nIter;
+        nSinc += rhs.nSinc;
+        nNaive += rhs.nNaive;
+        nFallback += rhs.nFallback;
+        nEdge += rhs.nEdge;
+        psfTime += rhs.psfTime;
+        smoothingTime += rhs.smoothingTime;
+        radiusTime += rhs.radiusTime;
+        sincTime += rhs.sincTime;
+        naiveTime += rhs.naiveTime;
+        return *this;
+    }
+
+    long nSource;                       ///< number of sources measured
+    long nIter;                         ///< number of iterations used to estimate Kron radii
+    long nSinc;                         ///< number of fluxes measured using sinc apertures
+    long nNaive;                        ///< number of fluxes measured by summing pixels
+    long nFallback;                     ///< number of Kron radii replaced by a fallback radius
+    long nEdge;                         ///< number of sources that failed as they hit the edge of the image
+    double psfTime;                     ///< time spent evaluating the PSF's Kron radius
+    double smoothingTime;               ///< time spent smoothing the image
+    double radiusTime;                  ///< time spent summing moments to estimate Kron radii
+    double sincTime;                    ///< time spent measuring fluxes using sinc apertures
+    double naiveTime;                   ///< time spent measuring fluxes by summing pixels
+};
+
+/// A source's final Kron aperture, in the pixel coordinates of the image on which it was measured
+struct KronApertureEntry {
+    afw::table::RecordId id;            ///< the source's ID
+    double x, y;                        ///< the aperture's centre
+    double a, b, theta;                 ///< the aperture's axes (theta in radians), for one Kron radius
+    double radiusForRadius;             ///< the radius of the aperture used to estimate R_K
+};
+
+/**
+ *  @brief A read-only file of Kron apertures, keyed by source ID and mapped directly into memory
+ *
+ *  The file is written by KronFluxAlgorithm::writeApertures(): a 16-byte header (an 8-byte magic string
+ *  and the number of entries) followed by the KronApertureEntries sorted by ID, in the native byte order.
+ *  Nothing is read or copied when the store is opened; pages are faulted in as entries are looked up.
+ */
+class KronApertureStore : private boost::noncopyable {
+public:
+    /// Map the store in fileName into memory
+    explicit KronApertureStore(std::string const & fileName);
+    ~KronApertureStore();
+
+    /// Return the number of apertures
+    std::size_t size() const { return _end - _begin; }
+
+    /// Return the aperture of the source with ID id, or NULL if there isn't one
+    KronApertureEntry const * find(afw::table::RecordId id) const;
+
+    /// Write entries (in any order) to fileName
+    static void write(std::string const & fileName, std::vector<KronApertureEntry> entries);
+
+private:
+    void * _map;                        // the mapped file
+    std::size_t _mapSize;               // the size of _map
+    KronApertureEntry const * _begin;   // the first entry in _map
+    KronApertureEntry const * _end;     // one past the last entry in _map
+};
+
+/**
+ *  @brief Return the pixels of an elliptical aperture that lie within bbox, as rasterised by the Kron code
+ *
+ *  The apertures are rasterised a row at a time without building a Footprint; the pixels are the same
+ *  as those of afw::detection::Footprint(ellipse) clipped to bbox, except (possibly) for those whose
+ *  centres lie exactly on the ellipse.  This is provided so that that can be checked.
+ */
+PTR(afw::detection::Footprint) makeEllipseFootprint(
+    afw::geom::ellipses::Ellipse const & ellipse,
+    afw::geom::Box2I const & bbox
+);
+
 /**
  *  @brief A measurement algorithm that estimates flux using Kron photometry
  */
@@ -90,6 +258,7 @@ public:
         SMALL_RADIUS,
         USED_MINIMUM_RADIUS,
         USED_PSF_RADIUS,
+        MASKED,
         N_FLAGS
     };
 
@@ -104,6 +273,64 @@ public:
         afw::image::Exposure<float> const & exposure
     ) const;
 
+    /**
+     *  @brief Measure all the sources in a catalog in one call
+     *
+     *  The results are identical to calling measure() on each record (and fail() if that throws a
+     *  recoverable exception), but the per-exposure setup (PSF handle, smoothing kernel) is only done
+     *  once.
+     *
+     *  If the control's nThreads != 1 the sources are divided between that many threads, each with
+     *  its own scratch space; the exposure is shared (read-only) between them.  The PSF isn't thread
+     *  safe, so all the quantities derived from it are evaluated serially before the threads start.
+     *  Threads only write to the records that they're measuring, so there's no locking around the
+     *  FlagHandler.  The sinc aperture coefficients are calculated using FFTW, whose planner isn't
+     *  thread safe, so only one thread at a time may calculate them; unless ctrl.sincCacheTolerance > 0
+     *  (so that each shape's coefficients are only calculated once) the sinc apertures are measured
+     *  serially.
+     */
+    void measureCatalog(
+        afw::table::SourceCatalog & catalog,
+        afw::image::Exposure<float> const & exposure
+    ) const;
+
+    /// As measureCatalog(catalog, Exposure<float>), but measuring the double-precision pixels directly
+    void measureCatalog(
+        afw::table::SourceCatalog & catalog,
+        afw::image::Exposure<double> const & exposure
+    ) const;
+
+    /**
+     *  @brief Measure all the sources in a catalog on an Exposure that's read from a file a tile at a time
+     *
+     *  The image is divided into tileSize x tileSize tiles, and each source is measured on the pixels of
+     *  the tile containing its centre plus tileMargin on each side, which are all that are held in memory.
+     *  Sources that need more pixels than that are measured at the end, each on a region grown until it
+     *  has all the pixels that it needs; the results are then the same as measureCatalog() on the whole
+     *  image.
+     */
+    void measureCatalogFromFile(
+        afw::table::SourceCatalog & catalog,
+        std::string const & fileName,
+        int tileSize=2048,
+        int tileMargin=256
+    ) const;
+
+    /**
+     *  @brief Measure the deblended children in a catalog without replacing the other sources with noise
+     *
+     *  Each source with a HeavyFootprint is measured on its own pixels composited over a Gaussian noise
+     *  realisation drawn from exposure's variance plane, covering only the region that its apertures
+     *  need (found by growing the region until it suffices); the random number generator is seeded with
+     *  noiseSeed plus the source's ID, so the results are reproducible.  The other sources (parents and
+     *  isolated objects) are measured on exposure as measureCatalog() would.
+     */
+    void measureChildren(
+        afw::table::SourceCatalog & catalog,
+        afw::image::Exposure<float> const & exposure,
+        int noiseSeed=0
+    ) const;
+
     virtual void measureForced(
         afw::table::SourceRecord & measRecord,
         afw::image::Exposure<float> const & exposure,
@@ -111,6 +338,94 @@ public:
         afw::image::Wcs const & refWcs
     ) const;
 
+    /**
+     *  @brief Measure all the sources in a catalog in forced mode in one call
+     *
+     *  The results are identical to calling measureForced() on each record (and fail() if that throws a
+     *  recoverable exception); measCatalog[i] is measured using refCatalog[i].  The reference radius key
+     *  and the transform between refWcs and the exposure's Wcs are only set up once.
+     */
+    void measureForcedCatalog(
+        afw::table::SourceCatalog & measCatalog,
+        afw::image::Exposure<float> const & exposure,
+        afw::table::SourceCatalog const & refCatalog,
+        afw::image::Wcs const & refWcs
+    ) const;
+
+    /**
+     *  @brief Measure the sources in several bands in one call, using the Kron apertures in refCatalog
+     *
+     *  bandCatalogs[j][i] is measured on *exposures[j] using refCatalog[i], just as measureForcedCatalog()
+     *  would; the reference radius key is only looked up, and each source's reference aperture only
+     *  built, once for all the bands.  The bands are measured one at a time, so each exposure's pixels
+     *  stay in cache while its sources are measured.  If an exposure's Wcs is the same as refWcs the
+     *  apertures are used without transforming them.
+     */
+    void measureBands(
+        std::vector<afw::table::SourceCatalog> & bandCatalogs,
+        std::vector<CONST_PTR(afw::image::Exposure<float>)> const & exposures,
+        afw::table::SourceCatalog const & refCatalog,
+        afw::image::Wcs const & refWcs
+    ) const;
+
+    /**
+     *  @brief Measure Kron fluxes for arrays of positions and shapes, without needing a catalog
+     *
+     *  Source i is centred at (x[i], y[i]) with second moments (ixx[i], iyy[i], ixy[i]); if any of them is
+     *  NaN the source is treated as having a bad shape.  On return flux[i], fluxSigma[i] and radius[i]
+     *  are the outputs of the algorithm, and flags[i] has bit j set if flag j (FAILURE, EDGE, ...) is
+     *  set.  The sources are measured by measureCatalog() using ctrl (which may not set
+     *  useFootprintRadius, as there are no Footprints); the records it needs are only created
+     *  internally.
+     */
+    static void measureArrays(
+        KronFluxControl const & ctrl,
+        afw::image::Exposure<float> const & exposure,
+        ndarray::Array<double const,1,1> const & x,
+        ndarray::Array<double const,1,1> const & y,
+        ndarray::Array<double const,1,1> const & ixx,
+        ndarray::Array<double const,1,1> const & iyy,
+        ndarray::Array<double const,1,1> const & ixy,
+        ndarray::Array<double,1,1> const & flux,
+        ndarray::Array<double,1,1> const & fluxSigma,
+        ndarray::Array<double,1,1> const & radius,
+        ndarray::Array<int,1,1> const & flags
+    );
+
+    /**
+     *  @brief Write the Kron apertures of the successfully measured sources in catalog to a
+     *         KronApertureStore in fileName
+     *
+     *  catalog must have been measured by this algorithm (or one with the same name and schema)
+     */
+    void writeApertures(
+        afw::table::SourceCatalog const & catalog,
+        std::string const & fileName
+    ) const;
+
+    /**
+     *  @brief Measure all the sources in a catalog in forced mode, using the apertures in store
+     *
+     *  As measureForcedCatalog(), but each source's reference aperture is the one in store with the
+     *  source's ID (measured on an image with Wcs refWcs), so no reference catalog is needed; sources
+     *  that aren't in store fail.  The radius used to estimate R_K is copied from store.
+     */
+    void measureForcedFromStore(
+        afw::table::SourceCatalog & measCatalog,
+        afw::image::Exposure<float> const & exposure,
+        KronApertureStore const & store,
+        afw::image::Wcs const & refWcs
+    ) const;
+
+    /// Return the statistics of the sinc coefficient cache (all zero if it isn't enabled)
+    SincCacheStats getSincCacheStats() const;
+
+    /// Return the timings and counts of all the measurements made so far (all zero unless ctrl.collectStats)
+    KronFluxStats getStats() const;
+
+    /// Reset the statistics returned by getStats()
+    void resetStats();
+
     virtual void fail(
         afw::table::SourceRecord & measRecord,
         meas::base::MeasurementError * error=NULL
@@ -118,10 +433,49 @@ public:
 
 private:
 
-    void _applyAperture(
+    // These are all templated on the Exposure's pixel type
+    template<typename PixelT> struct ExposureContext; // per-exposure state shared by all sources
+    template<typename PixelT> struct Workspace;       // per-thread scratch space
+    template<typename PixelT> class CatalogWorker;    // measures a catalog in one or more threads
+
+    template<typename PixelT>
+    void _measureCatalog(
+        afw::table::SourceCatalog & catalog,
+        afw::image::Exposure<PixelT> const & exposure,
+        afw::geom::Box2I const & fullBBox=afw::geom::Box2I(), // bbox of whole image; empty: exposure's
+        DeferredSources * deferred=NULL // where to put sources needing pixels beyond exposure; may be NULL
+    ) const;
+
+    void _resetRecord(afw::table::SourceRecord & source) const;
+
+    template<typename PixelT>
+    void _measure(
+        afw::table::SourceRecord & source,
+        ExposureContext<PixelT> const & context,
+        Workspace<PixelT> & workspace,
+        afw::geom::Point2D const & center,
+        double R_K_psf
+    ) const;
+
+    template<typename PixelT>
+    void _measureOrFail(
         afw::table::SourceRecord & source,
-        afw::image::Exposure<float> const& exposure,
-        KronAperture const& aperture
+        ExposureContext<PixelT> const & context,
+        Workspace<PixelT> & workspace,
+        afw::geom::Point2D const & center,
+        double R_K_psf
+    ) const;
+
+    /// Set the EDGE flag (and the general failure flags) in source, counting it in stats if non-NULL
+    void _failEdge(afw::table::SourceRecord & source, KronFluxStats *stats) const;
+
+    /// Measure the fluxes in aperture, returning false (with the EDGE flag set) if it hits the edge
+    template<typename PixelT>
+    bool _applyAperture(
+        afw::table::SourceRecord & source,
+        afw::image::Exposure<PixelT> const& exposure,
+        KronAperture const& aperture,
+        KronFluxStats *stats
         ) const;
 
     void _applyForced(
@@ -129,20 +483,50 @@ private:
         afw::image::Exposure<float> const & exposure,
         afw::geom::Point2D const & center,
         afw::table::SourceRecord const & reference,
+        afw::table::Key<float> const & refRadiusKey,
         afw::geom::AffineTransform const & refToMeas
     ) const;
 
-    PTR(KronAperture) _fallbackRadius(afw::table::SourceRecord& source, double const R_K_psf,
-                                      pex::exceptions::Exception& exc) const;
+    /// Measure source in aperture, returning false (with the EDGE flag set) if it hits the edge
+    bool _applyForced(
+        afw::table::SourceRecord & source,
+        afw::image::Exposure<float> const & exposure,
+        afw::geom::Point2D const & center,
+        KronAperture const & aperture
+    ) const;
+
+    double _getPsfKronRadius(
+        CONST_PTR(afw::detection::Psf) const & psf,
+        afw::geom::Box2I const & bbox,
+        afw::geom::Point2D const & center
+    ) const;
+
+    KronAperture _fallbackRadius(afw::table::SourceRecord& source, double const R_K_psf,
+                                 pex::exceptions::Exception& exc) const;
 
     std::string _name;
     Control _ctrl;
     meas::base::FluxResultKey _fluxResultKey;
     afw::table::Key<float> _radiusKey;
+    afw::table::Key<float> _radiusErrKey;
     afw::table::Key<float> _radiusForRadiusKey;
     afw::table::Key<float> _psfRadiusKey;
+    afw::table::Key<int> _nIterKey;
+    afw::table::Key<float> _maskedFractionKey;
     meas::base::FlagHandler _flagHandler;
     meas::base::SafeCentroidExtractor _centroidExtractor;
+    PTR(PsfKronRadiusCache) _psfRadiusCache; // NULL unless ctrl.psfRadiusGridSpacing > 0
+    PTR(WcsPairCache) _wcsPairCache;         // transform used by measureForced
+    PTR(ReferenceKeyCache) _refRadiusKeyCache; // key for our radius in reference catalogs
+    PTR(SincCoeffsCache) _sincCache;         // NULL unless ctrl.sincCacheTolerance > 0
+    PTR(KronFluxStatsCollector) _statsCollector; // NULL unless ctrl.collectStats
+    afw::image::MaskPixel _badBits;          // the bits of ctrl.badMaskPlanes; 0 if there are none
+    std::vector<double> _nRadiusForFlux;     // sorted, unique numbers of Kron radii to measure if there
+                                             // are extra apertures; else empty
+    std::size_t _mainIndex;                  // index of ctrl.nRadiusForFlux in _nRadiusForFlux
+    std::vector<std::size_t> _extraIndex;    // indices of ctrl.extraNRadiusForFlux in _nRadiusForFlux
+    std::vector<meas::base::FluxResultKey> _extraFluxResultKeys; // fluxes in extra apertures
+    std::vector<afw::table::Key<afw::table::Flag> > _extraFlagKeys; // failure flags for extra apertures
 };
 
 }}}} // namespace lsst::meas::extensions::photometryKron
@@ -20,6 +20,8 @@
 # see <http://www.lsstcorp.org/LegalNotices/>.
 #
 
+import numpy
+
 from .kronLib import *
 from .version import *
 
@@ -27,3 +29,18 @@ import lsst.meas.base
 lsst.meas.base.wrapSimpleAlgorithm(KronFluxAlgorithm, name="ext_photometryKron_KronFlux",
     Control=KronFluxControl, executionOrder=2.0, shouldApCorr=True)
 del lsst # cleanup namespace
+
+def measureKronArrays(exposure, x, y, ixx, iyy, ixy, ctrl=None):
+    """Measure the Kron fluxes of sources at (x, y) with second moments (ixx, iyy, ixy) on exposure
+
+    Returns numpy arrays (flux, fluxSigma, radius, flags), where flags[i] has bit j set if flag j of
+    KronFluxAlgorithm (FAILURE, EDGE, ...) is set for source i.  If ctrl (a KronFluxControl, e.g. from
+    config.makeControl()) is None the defaults are used.  No catalog or measurement task is needed.
+    """
+    if ctrl is None:
+        ctrl = KronFluxControl()
+    x, y, ixx, iyy, ixy = [numpy.ascontiguousarray(a, dtype=float) for a in (x, y, ixx, iyy, ixy)]
+    flux, fluxSigma, radius = [numpy.empty(len(x)) for i in range(3)]
+    flags = numpy.empty(len(x), dtype=numpy.intc)
+    KronFluxAlgorithm.measureArrays(ctrl, exposure, x, y, ixx, iyy, ixy, flux, fluxSigma, radius, flags)
+    return flux, fluxSigma, radius, flags
@@ -56,8 +56,19 @@ Interface to Kron magnitudes
 %include "lsst/pex/config.h"
 
 %{
+#include "ndarray/swig.h"
 #include "lsst/meas/extensions/photometryKron.h"
 %}
 
+// Arguments of KronFluxAlgorithm::measureArrays
+%include "ndarray.i"
+%declareNumPyConverters(ndarray::Array<double const,1,1>);
+%declareNumPyConverters(ndarray::Array<double,1,1>);
+%declareNumPyConverters(ndarray::Array<int,1,1>);
+
 %feature("notabstract") lsst::meas::extensions::photometryKron::KronFluxAlgorithm;
 %include "lsst/meas/extensions/photometryKron.h"
+
+// Arguments of KronFluxAlgorithm::measureBands
+%template(SourceCatalogVector) std::vector<lsst::afw::table::SourceCatalog>;
+%template(ExposureFConstPtrVector) std::vector<boost::shared_ptr<lsst::afw::image::Exposure<float> const> >;
@@ -24,22 +24,44 @@
 #include <numeric>
 #include <cmath>
 #include <functional>
+#include <algorithm>
+#include <map>
+#include <list>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "boost/cstdint.hpp"
+#include "boost/noncopyable.hpp"
+#include "boost/scoped_ptr.hpp"
+#include "boost/thread.hpp"
 #include "boost/math/constants/constants.hpp"
+#include "lsst/utils/ieee.h"
 #include "lsst/pex/exceptions.h"
 #include "lsst/afw/geom/Point.h"
 #include "lsst/afw/geom/Box.h"
 #include "lsst/afw/image/Exposure.h"
+#include "lsst/afw/image/Utils.h"
+#include "lsst/afw/image/XYTransformFromWcsPair.h"
 #include "lsst/afw/table/Source.h"
 #include "lsst/afw/math/Integrate.h"
 #include "lsst/afw/math/FunctionLibrary.h"
 #include "lsst/afw/math/KernelFunctions.h"
-#include "lsst/afw/detection/FootprintFunctor.h"
+#include "lsst/afw/math/offsetImage.h"
+#include "lsst/afw/math/Random.h"
+#include "lsst/afw/detection/Footprint.h"
+#include "lsst/afw/detection/HeavyFootprint.h"
 #include "lsst/afw/detection/Psf.h"
 #include "lsst/afw/coord/Coord.h"
 #include "lsst/afw/geom/AffineTransform.h"
 #include "lsst/afw/geom/ellipses.h"
 #include "lsst/meas/base.h"
 #include "lsst/meas/base/ApertureFlux.h"
+#include "lsst/meas/base/SincCoeffs.h"
 
 #include "lsst/meas/extensions/photometryKron.h"
 
@@ -53,39 +75,344 @@ LSST_EXCEPTION_TYPE(BadKronException, pex::exceptions::RuntimeError,
 
 namespace {
 
+/*
+ * Add the wall-clock time between construction and destruction to *total; do nothing if total is NULL
+ */
+class StageTimer {
+public:
+    explicit StageTimer(double *total) : _total(total), _start(total ? _getTime() : 0.0) {}
+    ~StageTimer() {
+        if (_total) {
+            *_total += _getTime() - _start;
+        }
+    }
+
+private:
+    static double _getTime() {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + 1e-6*tv.tv_usec;
+    }
+
+    double *const _total;               // where to accumulate the time; may be NULL
+    double const _start;                // when we started
+};
+
+/*
+ * Accumulate a sum using Neumaier's variant of Kahan's compensated summation
+ */
+class CompensatedSum {
+public:
+    CompensatedSum() : _sum(0.0), _compensation(0.0) {}
+
+    void reset() { _sum = _compensation = 0.0; }
+
+    CompensatedSum & operator+=(double const value) {
+        double const total = _sum + value;
+        if (std::fabs(_sum) >= std::fabs(value)) {
+            _compensation += (_sum - total) + value;
+        } else {
+            _compensation += (value - total) + _sum;
+        }
+        _sum = total;
+        return *this;
+    }
+
+    double get() const { return _sum + _compensation; }
+
+private:
+    double _sum;                        // the running sum
+    double _compensation;               // the accumulated low-order bits lost from _sum
+};
+
+/*
+ * Return the prefix for the fields of the flux within nRadius Kron radii, e.g. name_3_5 for 3.5
+ */
+std::string getApertureName(std::string const& name, double const nRadius) {
+    std::string suffix = (boost::format("%.1f") % nRadius).str();
+    std::replace(suffix.begin(), suffix.end(), '.', '_');
+    return name + "_" + suffix;
+}
+
+/*
+ * Return the bits of the named mask planes (0 if there are none, which disables masking)
+ */
+afw::image::MaskPixel getBadMaskBits(std::vector<std::string> const& planes) {
+    return planes.empty() ? 0 : afw::image::Mask<afw::image::MaskPixel>::getPlaneBitMask(planes);
+}
+
+/************************************************************************************************************/
+///
+/// The pixels whose centres lie within an ellipse, computed analytically a row at a time
+///
+/// This is equivalent to the Spans of an afw::detection::Footprint constructed from the ellipse, but
+/// nothing is allocated on the heap: the extent of each row is computed on the fly
+///
+class EllipseSpans {
+public:
+    EllipseSpans(afw::geom::ellipses::Axes const& axes, ///< the ellipse's shape
+                 afw::geom::Point2D const& center       ///< the ellipse's centre
+                ) : _xcen(center.getX()), _ycen(center.getY()), _bbox()
+    {
+        double const a2 = axes.getA()*axes.getA(), b2 = axes.getB()*axes.getB();
+        double const c = ::cos(axes.getTheta()), s = ::sin(axes.getTheta());
+        _iyy = a2*s*s + b2*c*c;
+        double const ixy = (a2 - b2)*c*s;
+        _det = a2*b2;                   // == Ixx*Iyy - Ixy^2
+        _slope = ixy/_iyy;
+
+        double const ymax = std::sqrt(_iyy);
+        _y0 = static_cast<int>(std::ceil(_ycen - ymax));
+        _y1 = static_cast<int>(std::floor(_ycen + ymax));
+        for (int y = _y0; y <= _y1; ++y) {
+            int x0, x1;
+            if (getSpan(y, &x0, &x1)) {
+                _bbox.include(afw::geom::Point2I(x0, y));
+                _bbox.include(afw::geom::Point2I(x1, y));
+            }
+        }
+        if (!_bbox.isEmpty()) {
+            _y0 = _bbox.getMinY();
+            _y1 = _bbox.getMaxY();
+        }
+    }
+
+    /// Return the bounding box of all the pixels; may be empty
+    afw::geom::Box2I const& getBBox() const { return _bbox; }
+
+    /// Return the first and last rows that may contain pixels
+    int getMinY() const { return _y0; }
+    int getMaxY() const { return _y1; }
+
+    /// Set [*x0, *x1] to the pixels in row y that lie within the ellipse; return false if there are none
+    bool getSpan(int const y, int *x0, int *x1) const {
+        double const dy = y - _ycen;
+        double const d2 = _det*(_iyy - dy*dy);
+        if (d2 < 0) {
+            return false;
+        }
+        double const xc = _xcen + _slope*dy;
+        double const halfWidth = std::sqrt(d2)/_iyy;
+        *x0 = static_cast<int>(std::ceil(xc - halfWidth));
+        *x1 = static_cast<int>(std::floor(xc + halfWidth));
+        return *x0 <= *x1;
+    }
+
+    /// As getSpan, but only return pixels that lie within bbox
+    bool getSpan(int const y, afw::geom::Box2I const& bbox, int *x0, int *x1) const {
+        if (y < bbox.getMinY() || y > bbox.getMaxY() || !getSpan(y, x0, x1)) {
+            return false;
+        }
+        *x0 = std::max(*x0, bbox.getMinX());
+        *x1 = std::min(*x1, bbox.getMaxX());
+        return *x0 <= *x1;
+    }
+
+private:
+    double _xcen, _ycen;                // centre of ellipse
+    double _iyy;                        // the ellipse's second moment in y
+    double _det;                        // the determinant of the ellipse's quadrupole matrix
+    double _slope;                      // Ixy/Iyy; d(centre of row)/dy
+    int _y0, _y1;                       // the first and last rows that may contain pixels
+    afw::geom::Box2I _bbox;             // bounding box of pixels
+};
+
+/************************************************************************************************************/
+///
+/// Sum the flux and variance within an elliptical aperture
+///
+/// Each row is summed contiguously into N_LANES independent partial sums (so the compiler can
+/// vectorise the loop), and the per-row totals are combined using compensated summation so that the
+/// result doesn't depend on the size of the aperture's rows.  The order of the additions only depends on
+/// the aperture, so the results are reproducible.
+///
+/// If badBits is non-zero the pixels with any of those mask bits set are skipped; each row is then summed
+/// as the runs of good pixels between them, counting the skipped pixels as we go
+///
 template <typename MaskedImageT>
-        class FootprintFlux : public afw::detection::FootprintFunctor<MaskedImageT> {
+class FootprintFlux {
 public:
-    explicit FootprintFlux(MaskedImageT const& mimage ///< The image the source lives in
-                          ) : afw::detection::FootprintFunctor<MaskedImageT>(mimage),
-                     _sum(0.0), _sumVar(0.0) {}
+    explicit FootprintFlux(MaskedImageT const& mimage, ///< The image the source lives in
+                           afw::image::MaskPixel const badBits=0 ///< Skip pixels with these mask bits set
+                          ) : _mimage(mimage), _badBits(badBits), _sum(), _sumVar(),
+                              _nPixel(0), _nMasked(0) {}
 
-    /// @brief Reset everything for a new Footprint
+    /// @brief Reset everything for a new aperture
     void reset() {
-        _sum = _sumVar = 0.0;
+        _sum.reset();
+        _sumVar.reset();
+        _nPixel = 0;
+        _nMasked = 0;
+    }
+
+    /// @brief Sum all the pixels in an aperture that lie within the image
+    void apply(EllipseSpans const& spans) {
+        reset();
+
+        afw::geom::Box2I const bbox = _mimage.getBBox();
+        int const xy0X = _mimage.getX0(), xy0Y = _mimage.getY0();
+        typename MaskedImageT::Image const& image = *_mimage.getImage();
+        typename MaskedImageT::Variance const& variance = *_mimage.getVariance();
+        typename MaskedImageT::Mask const& mask = *_mimage.getMask();
+        for (int y = spans.getMinY(); y <= spans.getMaxY(); ++y) {
+            int x0, x1;
+            if (spans.getSpan(y, bbox, &x0, &x1)) {
+                int const row = y - xy0Y, x = x0 - xy0X;
+                _addSpan(&*image.row_begin(row) + x, &*variance.row_begin(row) + x,
+                         _badBits ? &*mask.row_begin(row) + x : NULL, x1 - x0 + 1, _sum, _sumVar,
+                         _nPixel, _nMasked);
+            }
+        }
     }
-    void reset(afw::detection::Footprint const&) {}
 
-    /// @brief method called for each pixel by apply()
-    void operator()(typename MaskedImageT::xy_locator loc, ///< locator pointing at the pixel
-                    int,                                   ///< column-position of pixel
-                    int                                    ///< row-position of pixel
-                   ) {
-        typename MaskedImageT::Image::Pixel ival = loc.image(0, 0);
-        typename MaskedImageT::Variance::Pixel vval = loc.variance(0, 0);
-        _sum += ival;
-        _sumVar += vval;
+    /// @brief Sum the pixels that lie within the image in each of a set of nested apertures, in one pass
+    ///
+    /// The apertures must be concentric with the same shape, sorted from smallest to largest.  Each row of
+    /// the largest aperture is visited once, with each pixel added to the annulus of the smallest aperture
+    /// that contains it; the annuli are then accumulated.  On return (*sums)[i] and (*sumVars)[i] are the
+    /// flux and variance within apertures[i], and (*maskedFractions)[i] (if maskedFractions isn't NULL)
+    /// the fraction of its pixels that were skipped
+    void apply(std::vector<EllipseSpans> const& apertures, std::vector<double> *sums,
+               std::vector<double> *sumVars, std::vector<double> *maskedFractions=NULL) {
+        reset();
+        std::size_t const n = apertures.size();
+        sums->resize(n);
+        sumVars->resize(n);
+        if (maskedFractions) {
+            maskedFractions->resize(n);
+        }
+        if (n == 0) {
+            return;
+        }
+        std::vector<CompensatedSum> annulusSum(n), annulusSumVar(n);
+        std::vector<long> annulusNPixel(n, 0), annulusNMasked(n, 0);
+
+        afw::geom::Box2I const bbox = _mimage.getBBox();
+        int const xy0X = _mimage.getX0(), xy0Y = _mimage.getY0();
+        typename MaskedImageT::Image const& image = *_mimage.getImage();
+        typename MaskedImageT::Variance const& variance = *_mimage.getVariance();
+        typename MaskedImageT::Mask const& mask = *_mimage.getMask();
+        EllipseSpans const& outer = apertures.back();
+        // Only visit rows within the image, as we form pointers to the row before clipping the spans
+        int const y0 = std::max(outer.getMinY(), bbox.getMinY());
+        int const y1 = std::min(outer.getMaxY(), bbox.getMaxY());
+        for (int y = y0; y <= y1; ++y) {
+            int const row = y - xy0Y;
+            ImagePixel const* irow = &*image.row_begin(row);
+            VariancePixel const* vrow = &*variance.row_begin(row);
+            MaskPixel const* mrow = _badBits ? &*mask.row_begin(row) : NULL;
+            bool haveInner = false;     // have we summed part of this row?
+            int inner0 = 0, inner1 = -1; // the part of the row that we've summed
+            for (std::size_t i = 0; i != n; ++i) {
+                int x0, x1;
+                if (!apertures[i].getSpan(y, bbox, &x0, &x1)) {
+                    continue;
+                }
+                if (!haveInner) {
+                    int const x = x0 - xy0X;
+                    _addSpan(irow + x, vrow + x, mrow ? mrow + x : NULL, x1 - x0 + 1,
+                             annulusSum[i], annulusSumVar[i], annulusNPixel[i], annulusNMasked[i]);
+                } else {
+                    if (x0 < inner0) {
+                        int const x = x0 - xy0X;
+                        _addSpan(irow + x, vrow + x, mrow ? mrow + x : NULL, inner0 - x0,
+                                 annulusSum[i], annulusSumVar[i], annulusNPixel[i], annulusNMasked[i]);
+                    }
+                    if (x1 > inner1) {
+                        int const x = inner1 + 1 - xy0X;
+                        _addSpan(irow + x, vrow + x, mrow ? mrow + x : NULL, x1 - inner1,
+                                 annulusSum[i], annulusSumVar[i], annulusNPixel[i], annulusNMasked[i]);
+                    }
+                    x0 = std::min(x0, inner0);
+                    x1 = std::max(x1, inner1);
+                }
+                haveInner = true;
+                inner0 = x0;
+                inner1 = x1;
+            }
+        }
+
+        for (std::size_t i = 0; i != n; ++i) {
+            _sum += annulusSum[i].get();
+            _sumVar += annulusSumVar[i].get();
+            _nPixel += annulusNPixel[i];
+            _nMasked += annulusNMasked[i];
+            (*sums)[i] = _sum.get();
+            (*sumVars)[i] = _sumVar.get();
+            if (maskedFractions) {
+                (*maskedFractions)[i] = getMaskedFraction();
+            }
+        }
     }
 
-    /// Return the Footprint's flux
-    double getSum() const { return _sum; }
+    /// Return the aperture's flux
+    double getSum() const { return _sum.get(); }
+
+    /// Return the variance of the aperture's flux
+    double getSumVar() const { return _sumVar.get(); }
 
-    /// Return the variance of the Footprint's flux
-    double getSumVar() const { return _sumVar; }
+    /// Return the fraction of the aperture's pixels within the image that were skipped as they were masked
+    double getMaskedFraction() const {
+        return (_nPixel == 0) ? 0.0 : static_cast<double>(_nMasked)/_nPixel;
+    }
 
 private:
-    double _sum;
-    double _sumVar;
+    typedef typename MaskedImageT::Image::Pixel ImagePixel;
+    typedef typename MaskedImageT::Variance::Pixel VariancePixel;
+    typedef typename MaskedImageT::Mask::Pixel MaskPixel;
+    enum { N_LANES = 4 };               // number of independent partial sums
+
+    /// Add n pixels to the sums, skipping (and counting in nMasked) those with any of _badBits set in mrow
+    /// (if it isn't NULL); all n are counted in nPixel
+    void _addSpan(ImagePixel const* irow, VariancePixel const* vrow, MaskPixel const* mrow, int const n,
+                  CompensatedSum & total, CompensatedSum & totalVar, long & nPixel, long & nMasked) const {
+        nPixel += n;
+        if (!mrow) {
+            _addRun(irow, vrow, n, total, totalVar);
+            return;
+        }
+        for (int i = 0; i < n; ) {
+            if (mrow[i] & _badBits) {
+                ++nMasked;
+                ++i;
+                continue;
+            }
+            int j = i + 1;
+            while (j < n && !(mrow[j] & _badBits)) {
+                ++j;
+            }
+            _addRun(irow + i, vrow + i, j - i, total, totalVar);
+            i = j;
+        }
+    }
+
+    static void _addRun(ImagePixel const* irow, VariancePixel const* vrow, int const n,
+                        CompensatedSum & total, CompensatedSum & totalVar) {
+        double sum[N_LANES] = {0.0, 0.0, 0.0, 0.0};
+        double sumVar[N_LANES] = {0.0, 0.0, 0.0, 0.0};
+
+        int i = 0;
+        for (; i + N_LANES <= n; i += N_LANES) {
+            for (int j = 0; j != N_LANES; ++j) {
+                sum[j] += irow[i + j];
+                sumVar[j] += vrow[i + j];
+            }
+        }
+        for (; i < n; ++i) {
+            sum[0] += irow[i];
+            sumVar[0] += vrow[i];
+        }
+
+        total += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+        totalVar += (sumVar[0] + sumVar[1]) + (sumVar[2] + sumVar[3]);
+    }
+
+    MaskedImageT const& _mimage;        // the image we're measuring
+    MaskPixel const _badBits;           // skip pixels with any of these bits set
+    CompensatedSum _sum;                // sum of I
+    CompensatedSum _sumVar;             // sum of Var(I)
+    long _nPixel;                       // number of pixels in the aperture that lie within the image
+    long _nMasked;                      // number of those pixels that were skipped
 };
 
 /************************************************************************************************************/
@@ -99,61 +426,324 @@ private:
 /// In other words, it's the length of the major axis of the ellipse of specified shape that passes through
 /// the point
 ///
-template <typename MaskedImageT, typename WeightImageT>
-class FootprintFindMoment : public afw::detection::FootprintFunctor<MaskedImageT> {
+/// Rather than visiting the pixels one at a time via a FootprintFunctor we walk each row of the aperture
+/// as a contiguous array of pixels, accumulating into N_LANES independent partial sums so that the
+/// compiler is able to vectorise the loop; the special treatment of the central pixel is applied as a
+/// correction afterwards.
+///
+/// If floatLanes is true each row is instead processed in blocks of at most FLOAT_BLOCK pixels using
+/// N_FLOAT_LANES single-precision partial sums (radii included), and the block totals are added to the
+/// usual double-precision sums.  Each float sum has at most FLOAT_BLOCK/N_FLOAT_LANES + 3 terms and the
+/// radius costs a few roundings more, so the relative error of each block's sum of I*r is below about
+/// 16*2^-24 (1e-6) of its sum of |I*r|; between blocks we're as precise as before.  The error in <r> is
+/// therefore at most ~1e-6*sum(|I|)/sum(I), far below the 1e-2 tolerances that the tests apply.
+///
+/// If the image's variance is provided, the sums needed for the variance of <r> are accumulated in the
+/// same pass over the pixels.  If a mask and badBits are provided the pixels with any of those bits set
+/// are skipped; the mask may have a different origin from the image (which may be a smoothed subimage)
+///
+template <typename ImageT>
+class FootprintFindMoment {
 public:
-    FootprintFindMoment(MaskedImageT const& mimage, ///< The image the source lives in
+    enum { N_LANES = 4 };               // number of independent partial sums
+    enum { N_FLOAT_LANES = 8 };         // number of independent single-precision partial sums
+    enum { FLOAT_BLOCK = 64 };          // maximum number of pixels summed in single precision
+
+    typedef afw::image::Image<afw::image::VariancePixel> Variance;
+    typedef afw::image::Mask<afw::image::MaskPixel> Mask;
+
+    /// The partial sums of the moments, which may be used to continue the sums over a larger aperture
+    struct Moments {
+        double sum[N_LANES];            // sum of I
+        double sumR[N_LANES];           // sum of I*r
+        double sumVar;                  // sum of Var(I)
+        double sumRVar;                 // sum of r*Var(I)
+        double sumR2Var;                // sum of r^2*Var(I)
+    };
+
+    FootprintFindMoment(ImageT const& image,        ///< The image the source lives in
                         afw::geom::Point2D const& center, // center of the object
                         double const ab,                // axis ratio
-                        double const theta // rotation of ellipse +ve from x axis
-        ) : afw::detection::FootprintFunctor<MaskedImageT>(mimage),
+                        double const theta, // rotation of ellipse +ve from x axis
+                        bool const floatLanes=false, // accumulate blocks of pixels in single precision?
+                        Variance const* variance=NULL, // variance of image, or NULL if unknown
+                        Mask const* mask=NULL,          // mask of image, or NULL to use all pixels
+                        afw::image::MaskPixel const badBits=0 // skip pixels with these bits set in mask
+        ) : _image(image),
+                           _variance(variance),
+                           _mask(badBits ? mask : NULL),
+                           _badBits(badBits),
                            _xcen(center.getX()), _ycen(center.getY()),
-                           _ab(ab),
+                           _ab2(ab*ab),
                            _cosTheta(::cos(theta)),
                            _sinTheta(::sin(theta)),
-                           _sum(0.0), _sumR(0.0),
-#if 0
-                           _sumVar(0.0), _sumRVar(0.0),
-#endif
-                           _imageX0(mimage.getX0()), _imageY0(mimage.getY0())
-        {}
+                           _imageX0(image.getX0()), _imageY0(image.getY0()),
+                           _xCentral(static_cast<int>(std::floor(center.getX() + 0.5))),
+                           _yCentral(static_cast<int>(std::floor(center.getY() + 0.5))),
+                           _haveCentral(::hypot(_xCentral - _xcen, _yCentral - _ycen) < 0.5),
+                           _floatLanes(floatLanes)
+        {
+            reset();
+        }
 
-    /// @brief Reset everything for a new Footprint
-    void reset() {}
-    void reset(afw::detection::Footprint const& foot) {
-        _sum = _sumR = 0.0;
-#if 0
-        _sumVar = _sumRVar = 0.0;
-#endif
+    /// @brief Reset everything for a new aperture
+    void reset() {
+        std::fill(_sum, _sum + N_LANES, 0.0);
+        std::fill(_sumR, _sumR + N_LANES, 0.0);
+        _sumVar = _sumRVar = _sumR2Var = 0.0;
+    }
+    void reset(EllipseSpans const& spans) {
+        reset();
 
-        MaskedImageT const& mimage = this->getImage();
-        afw::geom::Box2I const& bbox(foot.getBBox());
+        afw::geom::Box2I const& bbox(spans.getBBox());
         int const x0 = bbox.getMinX(), y0 = bbox.getMinY(), x1 = bbox.getMaxX(), y1 = bbox.getMaxY();
 
         if (x0 < _imageX0 || y0 < _imageY0 ||
-            x1 >= _imageX0 + mimage.getWidth() || y1 >= _imageY0 + mimage.getHeight()) {
+            x1 >= _imageX0 + _image.getWidth() || y1 >= _imageY0 + _image.getHeight()) {
             throw LSST_EXCEPT(lsst::pex::exceptions::OutOfRangeError,
-                              (boost::format("Footprint %d,%d--%d,%d doesn't fit in image %d,%d--%d,%d")
+                              (boost::format("Aperture %d,%d--%d,%d doesn't fit in image %d,%d--%d,%d")
                                % x0 % y0 % x1 % y1
                                % _imageX0 % _imageY0
-                               % (_imageX0 + mimage.getWidth() - 1) % (_imageY0 + mimage.getHeight() - 1)
+                               % (_imageX0 + _image.getWidth() - 1) % (_imageY0 + _image.getHeight() - 1)
                               ).str());
         }
     }
 
-    /// @brief method called for each pixel by apply()
-    void operator()(typename MaskedImageT::xy_locator iloc, ///< locator pointing at the image pixel
-                    int x,                                  ///< column-position of pixel
-                    int y                                   ///< row-position of pixel
-                   ) {
-        double const dx = x - _xcen;
+    /// @brief Accumulate the moments of all the pixels in an aperture, which must lie within the image
+    void apply(EllipseSpans const& spans) {
+        reset(spans);
+
+        for (int y = spans.getMinY(); y <= spans.getMaxY(); ++y) {
+            int x0, x1;
+            if (spans.getSpan(y, &x0, &x1)) {
+                _addSpan(x0, x1, y);
+            }
+        }
+    }
+
+    /// @brief Accumulate the moments of all the pixels in outer, given the moments of those in inner
+    ///
+    /// The apertures must be concentric with the same shape (so each pixel's elliptical radius is the same
+    /// in both), inner must lie within outer, and outer must lie within the image.  Only the pixels in the
+    /// annulus between the apertures are visited; if the central pixel is in the annulus its correction is
+    /// applied just as it would be by apply()
+    void applyAnnulus(EllipseSpans const& inner, Moments const& innerMoments, EllipseSpans const& outer) {
+        reset(outer);
+        std::copy(innerMoments.sum, innerMoments.sum + N_LANES, _sum);
+        std::copy(innerMoments.sumR, innerMoments.sumR + N_LANES, _sumR);
+        _sumVar = innerMoments.sumVar;
+        _sumRVar = innerMoments.sumRVar;
+        _sumR2Var = innerMoments.sumR2Var;
+
+        for (int y = outer.getMinY(); y <= outer.getMaxY(); ++y) {
+            int x0, x1;
+            if (!outer.getSpan(y, &x0, &x1)) {
+                continue;
+            }
+            int innerX0, innerX1;
+            if (!inner.getSpan(y, &innerX0, &innerX1) || innerX1 < x0 || innerX0 > x1) {
+                _addSpan(x0, x1, y);
+                continue;
+            }
+            if (x0 < innerX0) {
+                _addSpan(x0, innerX0 - 1, y);
+            }
+            if (x1 > innerX1) {
+                _addSpan(innerX1 + 1, x1, y);
+            }
+        }
+    }
+
+    /// Return the partial sums of the moments
+    Moments getMoments() const {
+        Moments moments;
+        std::copy(_sum, _sum + N_LANES, moments.sum);
+        std::copy(_sumR, _sumR + N_LANES, moments.sumR);
+        moments.sumVar = _sumVar;
+        moments.sumRVar = _sumRVar;
+        moments.sumR2Var = _sumR2Var;
+        return moments;
+    }
+
+    /// Return the aperture's <r_elliptical>
+    double getIr() const { return _total(_sumR)/_total(_sum); }
+
+    /// Return the variance of the aperture's <r>, or NaN if we don't have the image's variance
+    ///
+    /// This is sum((r - <r>)^2 Var(I))/sum(I)^2, i.e. we neglect the aperture's dependence on the data
+    double getIrVar() const {
+        if (!_variance) {
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+        double const sum = _total(_sum);
+        double const ir = getIr();
+        return std::max(0.0, _sumR2Var - 2*ir*_sumRVar + ir*ir*_sumVar)/(sum*sum);
+    }
+
+    /// Return whether the measurement might be trusted
+    bool getGood() const { return _total(_sum) > 0 && _total(_sumR) > 0; }
+
+private:
+    typedef typename ImageT::Pixel ImagePixel;
+    typedef typename Variance::Pixel VariancePixel;
+
+    static double _total(double const *lanes) {
+        return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+
+    static float _floatTotal(float const *lanes) {
+        return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+            ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    }
+
+    /// Return the elliptical radius of the pixel (dx, dy) from the centre, given dy*{sin,cos}(theta)
+    double _radius(double const dx, double const dySin, double const dyCos) const {
+        double const du =  dx*_cosTheta + dySin;
+        double const dv = -dx*_sinTheta + dyCos;
+        return std::sqrt(du*du + _ab2*dv*dv); // ellipsoidal radius
+    }
+
+    /// Add n pixels starting at row (and vrow if WITH_VARIANCE), the first of which is dx0 from the centre
+    template <bool WITH_VARIANCE>
+    void _addDoubleSpan(ImagePixel const* row, VariancePixel const* vrow,
+                        double const dx0, double const dySin, double const dyCos, int const n) {
+        double sumVar = 0.0, sumRVar = 0.0, sumR2Var = 0.0;
+        int i = 0;
+        for (; i + N_LANES <= n; i += N_LANES) {
+            for (int j = 0; j != N_LANES; ++j) {
+                double const r = _radius(dx0 + (i + j), dySin, dyCos);
+                double const ival = row[i + j];
+                _sum[j] += ival;
+                _sumR[j] += r*ival;
+                if (WITH_VARIANCE) {
+                    double const var = vrow[i + j];
+                    sumVar += var;
+                    sumRVar += r*var;
+                    sumR2Var += r*r*var;
+                }
+            }
+        }
+        for (; i < n; ++i) {
+            double const r = _radius(dx0 + i, dySin, dyCos);
+            double const ival = row[i];
+            _sum[0] += ival;
+            _sumR[0] += r*ival;
+            if (WITH_VARIANCE) {
+                double const var = vrow[i];
+                sumVar += var;
+                sumRVar += r*var;
+                sumR2Var += r*r*var;
+            }
+        }
+        if (WITH_VARIANCE) {
+            _sumVar += sumVar;
+            _sumRVar += sumRVar;
+            _sumR2Var += sumR2Var;
+        }
+    }
+
+    /// Add n <= FLOAT_BLOCK pixels starting at row (and vrow if WITH_VARIANCE), the first of which is dx0
+    /// from the centre, accumulating in single precision; the block totals are added to lane 0 of the
+    /// double-precision sums
+    template <bool WITH_VARIANCE>
+    void _addFloatBlock(ImagePixel const* row, VariancePixel const* vrow,
+                        double const dx0, double const dySin, double const dyCos, int const n) {
+        float const cosTheta = _cosTheta, sinTheta = _sinTheta, ab2 = _ab2;
+        float const fdx0 = dx0, fdySin = dySin, fdyCos = dyCos;
+        float sum[N_FLOAT_LANES] = {0, 0, 0, 0, 0, 0, 0, 0};
+        float sumR[N_FLOAT_LANES] = {0, 0, 0, 0, 0, 0, 0, 0};
+        float sumVar = 0, sumRVar = 0, sumR2Var = 0;
+
+        int i = 0;
+        for (; i + N_FLOAT_LANES <= n; i += N_FLOAT_LANES) {
+            for (int j = 0; j != N_FLOAT_LANES; ++j) {
+                float const dx = fdx0 + (i + j);
+                float const du =  dx*cosTheta + fdySin;
+                float const dv = -dx*sinTheta + fdyCos;
+                float const r = std::sqrt(du*du + ab2*dv*dv);
+                float const ival = row[i + j];
+                sum[j] += ival;
+                sumR[j] += r*ival;
+                if (WITH_VARIANCE) {
+                    float const var = vrow[i + j];
+                    sumVar += var;
+                    sumRVar += r*var;
+                    sumR2Var += r*r*var;
+                }
+            }
+        }
+        for (; i < n; ++i) {
+            float const dx = fdx0 + i;
+            float const du =  dx*cosTheta + fdySin;
+            float const dv = -dx*sinTheta + fdyCos;
+            float const r = std::sqrt(du*du + ab2*dv*dv);
+            float const ival = row[i];
+            sum[0] += ival;
+            sumR[0] += r*ival;
+            if (WITH_VARIANCE) {
+                float const var = vrow[i];
+                sumVar += var;
+                sumRVar += r*var;
+                sumR2Var += r*r*var;
+            }
+        }
+
+        _sum[0] += _floatTotal(sum);
+        _sumR[0] += _floatTotal(sumR);
+        if (WITH_VARIANCE) {
+            _sumVar += sumVar;
+            _sumRVar += sumRVar;
+            _sumR2Var += sumR2Var;
+        }
+    }
+
+    /// Add the pixels [x0, x1] in row y, skipping those with any of _badBits set in _mask
+    void _addSpan(int const x0, int const x1, int const y) {
+        if (!_mask) {
+            _addGoodSpan(x0, x1, y);
+            return;
+        }
+        // mrow[i] is the mask of pixel x0 + i
+        afw::image::MaskPixel const* mrow = &*_mask->row_begin(y - _mask->getY0()) + (x0 - _mask->getX0());
+        for (int x = x0; x <= x1; ) {
+            if (mrow[x - x0] & _badBits) {
+                ++x;
+                continue;
+            }
+            int end = x;                // the last good pixel in this run
+            while (end < x1 && !(mrow[end + 1 - x0] & _badBits)) {
+                ++end;
+            }
+            _addGoodSpan(x, end, y);
+            x = end + 1;
+        }
+    }
+
+    /// Add all the pixels [x0, x1] in row y
+    void _addGoodSpan(int const x0, int const x1, int const y) {
+        ImagePixel const* row = &*_image.row_begin(y - _imageY0) + (x0 - _imageX0);
+        VariancePixel const* vrow = _variance ? &*_variance->row_begin(y - _imageY0) + (x0 - _imageX0) : NULL;
+        double const dx0 = x0 - _xcen;
         double const dy = y - _ycen;
-        double const du =  dx*_cosTheta + dy*_sinTheta;
-        double const dv = -dx*_sinTheta + dy*_cosTheta;
+        double const dySin = dy*_sinTheta, dyCos = dy*_cosTheta;
+        int const n = x1 - x0 + 1;
+
+        if (_floatLanes) {
+            for (int i = 0; i < n; i += FLOAT_BLOCK) {
+                int const nBlock = std::min(n - i, int(FLOAT_BLOCK));
+                if (vrow) {
+                    _addFloatBlock<true>(row + i, vrow + i, dx0 + i, dySin, dyCos, nBlock);
+                } else {
+                    _addFloatBlock<false>(row + i, NULL, dx0 + i, dySin, dyCos, nBlock);
+                }
+            }
+        } else if (vrow) {
+            _addDoubleSpan<true>(row, vrow, dx0, dySin, dyCos, n);
+        } else {
+            _addDoubleSpan<false>(row, NULL, dx0, dySin, dyCos, n);
+        }
 
-        double r = ::hypot(du, dv*_ab); // ellipsoidal radius
-#if 1
-        if (::hypot(dx, dy) < 0.5) {    // within a pixel of the centre
+        if (_haveCentral && y == _yCentral && x0 <= _xCentral && _xCentral <= x1) {
             /*
              * We gain significant precision for flattened Gaussians by treating the central pixel specially
              *
@@ -164,165 +754,686 @@ public:
              * We could avoid all these issues by estimating <r> using the same trick as we use for
              * the sinc fluxes; it's not clear that it's worth it.
              */
-
             double const eR = 0.38259771140356325; // <r> for a single square pixel, about the centre
-            r = ::hypot(r, eR*(1 + ::hypot(dx, dy)/afw::geom::ROOT2));
+            double const dx = _xCentral - _xcen;
+            double const r = _radius(dx, dySin, dyCos);
+            double const rCentral = ::hypot(r, eR*(1 + ::hypot(dx, dy)/afw::geom::ROOT2));
+            _sumR[0] += (rCentral - r)*row[_xCentral - x0];
+            if (vrow) {
+                double const var = vrow[_xCentral - x0];
+                _sumRVar += (rCentral - r)*var;
+                _sumR2Var += (rCentral*rCentral - r*r)*var;
+            }
         }
-#endif
-
-        typename MaskedImageT::Image::Pixel ival = iloc.image(0, 0);
-        _sum += ival;
-        _sumR += r*ival;
-#if 0
-        typename MaskedImageT::Variance::Pixel vval = iloc.variance(0, 0);
-        _sumVar += vval;
-        _sumRVar += r*r*vval;
-#endif
     }
 
-    /// Return the Footprint's <r_elliptical>
-    double getIr() const { return _sumR/_sum; }
-
-#if 0
-    /// Return the variance of the Footprint's <r>
-//    double getIrVar() const { return _sumRVar/_sum - getIr()*getIr(); } // Wrong?
-    double getIrVar() const { return _sumRVar/(_sum*_sum) + _sumVar*_sumR*_sumR/::pow(_sum, 4); }
-#endif
-
-    /// Return whether the measurement might be trusted
-    bool getGood() const { return _sum > 0 && _sumR > 0; }
-
-private:
+    ImageT const& _image;               // the image we're measuring
+    Variance const* _variance;          // the image's variance; may be NULL
+    Mask const* _mask;                  // the image's mask; NULL if we're using all the pixels
+    afw::image::MaskPixel const _badBits; // skip pixels with any of these bits set in _mask
     double const _xcen;                 // center of object
     double const _ycen;                 // center of object
-    double const _ab;                   // axis ratio
+    double const _ab2;                  // (axis ratio)^2
     double const _cosTheta, _sinTheta;  // {cos,sin}(angle from x-axis)
-    double _sum;                        // sum of I
-    double _sumR;                       // sum of R*I
-#if 0
+    double _sum[N_LANES];               // sum of I
+    double _sumR[N_LANES];              // sum of R*I
     double _sumVar;                     // sum of Var(I)
-    double _sumRVar;                    // sum of R*R*Var(I)
-#endif
+    double _sumRVar;                    // sum of R*Var(I)
+    double _sumR2Var;                   // sum of R*R*Var(I)
     int const _imageX0, _imageY0;       // origin of image we're measuring
-
+    int const _xCentral, _yCentral;     // the pixel closest to the centre of the object
+    bool const _haveCentral;            // is (_xCentral, _yCentral) within half a pixel of the centre?
+    bool const _floatLanes;             // accumulate blocks of pixels in single precision?
 };
-} // end anonymous namespace
 
+/*
+ * Return the N(0, sigma^2) kernel used to smooth the image while estimating R_K, or null if sigma <= 0
+ *
+ * The kernels are cached, so we only construct one per value of sigma
+ */
+CONST_PTR(afw::math::SeparableKernel) getSmoothingKernel(double const sigma)
+{
+    typedef std::map<double, CONST_PTR(afw::math::SeparableKernel)> KernelCache;
+    static KernelCache cache;
+    static boost::mutex mutex;          // protects cache
 
-struct KronAperture {
-    KronAperture(afw::geom::Point2D const& center, afw::geom::ellipses::BaseCore const& core) :
-        _center(center), _axes(core) {}
-    explicit KronAperture(afw::table::SourceRecord const& source) :
-        _center(afw::geom::Point2D(source.getX(), source.getY())), _axes(source.getShape()) {}
-    KronAperture(afw::table::SourceRecord const& reference, afw::geom::AffineTransform const& refToMeas,
-                 double radius) :
-        _center(refToMeas(reference.getCentroid())),
-        _axes(_getKronAxes(reference.getShape(), refToMeas.getLinear(), radius))
+    if (sigma <= 0) {
+        return CONST_PTR(afw::math::SeparableKernel)();
+    }
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    KernelCache::const_iterator const ptr = cache.find(sigma);
+    if (ptr != cache.end()) {
+        return ptr->second;
+    }
+    int const kSize = 2*int(2*sigma) + 1;
+    afw::math::GaussianFunction1<afw::math::Kernel::Pixel> gaussFunc(sigma);
+    CONST_PTR(afw::math::SeparableKernel) kernel =
+        boost::make_shared<afw::math::SeparableKernel>(kSize, kSize, gaussFunc, gaussFunc);
+    cache[sigma] = kernel;
+    return kernel;
+}
+
+/************************************************************************************************************/
+///
+/// A cache of an entire image plane smoothed with a kernel, which is evaluated lazily in square tiles
+///
+/// A tile is computed the first time that it's needed and then shared (by reference counting) by all
+/// the threads that use it; if more than maxTiles are held the least recently used are discarded (and
+/// freed when no thread still holds them).  Each tile is smoothed including the kernel's half-width of
+/// its neighbours, so the pixel values are the same as if the whole image had been smoothed at once.
+///
+/// The cache is thread safe.
+///
+template<typename PixelT>
+class SmoothedImageCache {
+public:
+    typedef afw::image::Image<PixelT> Image;
+
+    SmoothedImageCache(Image const& image,                   ///< the image to smooth
+                       CONST_PTR(afw::math::SeparableKernel) kernel, ///< kernel to smooth with
+                       int const tileSize,                   ///< size of tiles; <= 0: the whole image
+                       int const maxTiles                    ///< max. number of tiles to keep; <= 0: all
+                      ) :
+        _image(image),
+        _kernel(kernel),
+        _tileSize(tileSize > 0 ?
+                  afw::geom::Extent2I(tileSize, tileSize) : image.getDimensions()),
+        _maxTiles(maxTiles),
+        _convCtrl(true, false)
         {}
 
+    /// Is this a cache of image?
+    bool isCacheOf(Image const& image) const {
+        return &*image.row_begin(0) == &*_image.row_begin(0) && image.getBBox() == _image.getBBox();
+    }
 
-    /// Accessors
-    double getX() const { return _center.getX(); }
-    double getY() const { return _center.getY(); }
-    afw::geom::Point2D const& getCenter() const { return _center; }
-    afw::geom::ellipses::Axes & getAxes() { return _axes; }
-    afw::geom::ellipses::Axes const& getAxes() const { return _axes; }
+    /// Copy the smoothed pixels within bbox (PARENT coordinates; must lie within the image) to out
+    void copy(afw::geom::Box2I const& bbox, Image & out) {
+        afw::geom::Point2I const xy0 = _image.getXY0();
+        int const ix0 = (bbox.getMinX() - xy0.getX())/_tileSize.getX();
+        int const ix1 = (bbox.getMaxX() - xy0.getX())/_tileSize.getX();
+        int const iy0 = (bbox.getMinY() - xy0.getY())/_tileSize.getY();
+        int const iy1 = (bbox.getMaxY() - xy0.getY())/_tileSize.getY();
+        for (int iy = iy0; iy <= iy1; ++iy) {
+            for (int ix = ix0; ix <= ix1; ++ix) {
+                CONST_PTR(Image) tile = _getTile(ix, iy);
+                afw::geom::Box2I overlap(tile->getBBox());
+                overlap.clip(bbox);
+                Image(out, overlap, afw::image::PARENT, false) <<=
+                    Image(*tile, overlap, afw::image::PARENT, false);
+            }
+        }
+    }
 
-    /// Determine the Kron Aperture from an image
-    template<typename ImageT>
-    static PTR(KronAperture) determine(ImageT const& image,
-                                       afw::geom::ellipses::Axes axes,
-                                       afw::geom::Point2D const& center,
-                                       KronFluxControl const& ctrl, float *radiusForRadius
-                                      );
+private:
+    typedef std::pair<int, int> TileId;
+    typedef std::list<TileId> TileList;
+    struct Tile {
+        CONST_PTR(Image) image;         // the smoothed pixels
+        TileList::iterator lru;         // our position in the list of tiles ordered by when they were used
+    };
+    typedef std::map<TileId, Tile> TileMap;
+
+    /// Return tile (ix, iy), smoothing it if needed
+    CONST_PTR(Image) _getTile(int const ix, int const iy) {
+        TileId const id(ix, iy);
+        {
+            boost::lock_guard<boost::mutex> lock(_mutex);
+            typename TileMap::iterator const ptr = _tiles.find(id);
+            if (ptr != _tiles.end()) {
+                _lru.splice(_lru.begin(), _lru, ptr->second.lru); // we're the most recently used
+                return ptr->second.image;
+            }
+        }
 
-    /// Photometer within the Kron Aperture on an image
-    template<typename ImageT>
-    std::pair<double, double> measure(ImageT const& image, // Image to measure
-                                      double const nRadiusForFlux, // Kron radius multiplier
-                                      double const maxSincRadius // largest radius that we use sinc apertyres
-                                     ) const;
+        CONST_PTR(Image) const image = _smoothTile(ix, iy); // don't hold the lock while smoothing
 
-    /// Transform a Kron Aperture to a different frame
-    PTR(KronAperture) transform(afw::geom::AffineTransform const& trans) const {
-        afw::geom::Point2D const center = trans(getCenter());
-        afw::geom::ellipses::Axes const axes(*getAxes().transform(trans.getLinear()).copy());
-        return boost::make_shared<KronAperture>(center, axes);
+        boost::lock_guard<boost::mutex> lock(_mutex);
+        typename TileMap::iterator const ptr = _tiles.find(id);
+        if (ptr != _tiles.end()) {      // another thread beat us to it
+            return ptr->second.image;
+        }
+        Tile & tile = _tiles[id];
+        tile.image = image;
+        tile.lru = _lru.insert(_lru.begin(), id);
+        while (_maxTiles > 0 && static_cast<int>(_tiles.size()) > _maxTiles) {
+            _tiles.erase(_lru.back());
+            _lru.pop_back();
+        }
+
+        return image;
     }
 
-private:
-    /// Determine Kron axes from a reference image
-    static
-    afw::geom::ellipses::Axes _getKronAxes(
-        afw::geom::ellipses::Axes const& shape,
-        afw::geom::LinearTransform const& transformation,
-        double const radius
-        );
+    /// Smooth tile (ix, iy)
+    PTR(Image) _smoothTile(int const ix, int const iy) const {
+        afw::geom::Box2I bbox(_image.getXY0() +
+                              afw::geom::Extent2I(ix*_tileSize.getX(), iy*_tileSize.getY()), _tileSize);
+        bbox.clip(_image.getBBox());
+        afw::geom::Box2I region(_kernel->growBBox(bbox)); // the region needed to smooth bbox
+        region.clip(_image.getBBox());
 
-    afw::geom::Point2D const _center;     // Center of aperture
-    afw::geom::ellipses::Axes _axes;      // Ellipse defining aperture shape
+        // convolve() sets the pixels within the kernel's half-width of region's edge to NaN, but those
+        // that lie within bbox are at the edge of the image, so smoothing the whole image would too
+        Image smoothed(region);
+        afw::math::convolve(smoothed, Image(_image, region, afw::image::PARENT, false), *_kernel, _convCtrl);
+
+        return boost::make_shared<Image>(smoothed, bbox, afw::image::PARENT, false);
+    }
+
+    Image const _image;                            // the image we're caching a smoothed version of
+    CONST_PTR(afw::math::SeparableKernel) _kernel; // the smoothing kernel
+    afw::geom::Extent2I const _tileSize;           // size of our tiles
+    int const _maxTiles;                           // maximum number of tiles to keep
+    afw::math::ConvolutionControl const _convCtrl; // how to convolve
+    boost::mutex _mutex;                           // protects _tiles and _lru
+    TileMap _tiles;                                // the tiles that we've smoothed
+    TileList _lru;                                 // ids of tiles, most recently used first
 };
 
+/************************************************************************************************************/
+///
+/// Smooth regions of the image plane of an image, reusing a scratch buffer from call to call
+///
+/// Only the image plane is smoothed, as that's all that we use when estimating R_K.  Requests may be padded
+/// so that if the next request (e.g. the next iteration's slightly larger aperture) lies within the region
+/// that we've already smoothed we can return it without convolving again; there's no point in padding the
+/// last aperture that we'll use for a source (e.g. the only one, if nIterForRadius == 1).
+///
+/// If a SmoothedImageCache of the image is provided the smoothed pixels are copied from it rather than
+/// being convolved afresh.
+///
+/// A Smoother isn't thread safe; each thread needs its own
+///
+template<typename PixelT>
+class Smoother {
+public:
+    typedef afw::image::Image<PixelT> Image;
+
+    explicit Smoother(CONST_PTR(afw::math::SeparableKernel) kernel, ///< kernel to smooth with
+                      PTR(SmoothedImageCache<PixelT>) cache=PTR(SmoothedImageCache<PixelT>)() ///< or NULL
+                     ) : _kernel(kernel), _cache(cache), _convCtrl(true, false),
+                         _sourcePixels(NULL), _sourceBBox(), _valid() {}
+    /// Return the smoothing kernel
+    afw::math::SeparableKernel const& getKernel() const { return *_kernel; }
+
+    /// Return an image that contains bbox (PARENT coordinates), smoothed with our kernel
+    ///
+    /// If pad is true we smooth a region larger than bbox, anticipating a larger request to come.
+    /// The returned image may be larger than bbox.  The pixels within the kernel's half-width of its edge
+    /// are set to NaN by convolve(), so bbox should include that border around the pixels that are needed;
+    /// the pixels inside it are the same however much we pad.  The returned image is a view
+    /// into our scratch buffer, so is only valid until the next call to smooth().  The image mustn't be
+    /// modified while we're using it.
+    Image smooth(Image const& image, afw::geom::Box2I const& bbox, bool const pad=true) {
+        PixelT const* const pixels = &*image.row_begin(0);
+        if (pixels == _sourcePixels && image.getBBox() == _sourceBBox && _valid.contains(bbox)) {
+            return *_smoothed;
+        }
 
-afw::geom::ellipses::Axes KronAperture::_getKronAxes(
-    afw::geom::ellipses::Axes const& shape,
-    afw::geom::LinearTransform const& transformation,
-    double const radius
+        afw::geom::Box2I region(bbox);
+        if (pad) {
+            region.grow(afw::geom::Extent2I(std::max(1, bbox.getWidth()/PADDING),
+                                            std::max(1, bbox.getHeight()/PADDING)));
+        }
+        region.clip(image.getBBox());
+
+        afw::geom::Extent2I const dims = region.getDimensions();
+        if (!_buffer || _buffer->getWidth() < dims.getX() || _buffer->getHeight() < dims.getY()) {
+            int const width = _buffer ? std::max(_buffer->getWidth(), dims.getX()) : dims.getX();
+            int const height = _buffer ? std::max(_buffer->getHeight(), dims.getY()) : dims.getY();
+            _smoothed.reset();
+            _buffer.reset(new Image(afw::geom::Extent2I(width, height)));
+        }
+        _smoothed.reset(new Image(*_buffer, afw::geom::Box2I(afw::geom::Point2I(0, 0), dims),
+                                  afw::image::LOCAL, false));
+        _smoothed->setXY0(region.getMin());
+
+        if (_cache && _cache->isCacheOf(image)) {
+            _cache->copy(region, *_smoothed);
+        } else {
+            afw::math::convolve(*_smoothed, Image(image, region, afw::image::PARENT, false), *_kernel,
+                                _convCtrl);
+        }
+
+        _sourcePixels = pixels;
+        _sourceBBox = image.getBBox();
+        _valid = region;
+
+        return *_smoothed;
+    }
+
+private:
+    enum { PADDING = 4 };               // pad regions by 1/PADDING of their size on each side, if asked
+
+    CONST_PTR(afw::math::SeparableKernel) _kernel; // the smoothing kernel
+    PTR(SmoothedImageCache<PixelT>) _cache;        // cache of the smoothed image; may be NULL
+    afw::math::ConvolutionControl const _convCtrl; // how to convolve
+    boost::scoped_ptr<Image> _buffer;              // scratch space for smoothed image
+    boost::scoped_ptr<Image> _smoothed;            // the part of _buffer that we last smoothed
+    PixelT const* _sourcePixels;                   // the pixels of the image that we last smoothed
+    afw::geom::Box2I _sourceBBox;                  // the bbox of the image that we last smoothed
+    afw::geom::Box2I _valid;                       // the region of the image in _smoothed
+};
+
+/*
+ * Smooth the region bbox of image (padded if pad), adding the time taken to *time if it isn't NULL
+ */
+template<typename PixelT>
+afw::image::Image<PixelT> smoothRegion(Smoother<PixelT> *smoother, afw::image::Image<PixelT> const& image,
+                                       afw::geom::Box2I const& bbox, double *time, bool const pad) {
+    StageTimer timer(time);
+    return smoother->smooth(image, bbox, pad);
+}
+} // end anonymous namespace
+
+PTR(afw::detection::Footprint) makeEllipseFootprint(
+    afw::geom::ellipses::Ellipse const& ellipse,
+    afw::geom::Box2I const& bbox
     )
 {
-    afw::geom::ellipses::Axes axes(shape);
-    axes.scale(radius/axes.getDeterminantRadius());
-    return axes.transform(transformation);
+    EllipseSpans const spans(afw::geom::ellipses::Axes(ellipse.getCore()), ellipse.getCenter());
+    PTR(afw::detection::Footprint) footprint = boost::make_shared<afw::detection::Footprint>();
+    for (int y = spans.getMinY(); y <= spans.getMaxY(); ++y) {
+        int x0, x1;
+        if (spans.getSpan(y, bbox, &x0, &x1)) {
+            footprint->addSpan(y, x0, x1);
+        }
+    }
+    return footprint;
 }
 
+/************************************************************************************************************/
+/*
+ * Serialises the calculation of sinc aperture coefficients between all threads in the process
+ *
+ * The coefficients are calculated by meas_base using FFTW, and only fftw_execute is thread safe; planning
+ * the transforms isn't, so two threads mustn't calculate coefficients at the same time
+ */
+namespace {
+boost::mutex sincCoeffsMutex;
+} // end anonymous namespace
 
+/************************************************************************************************************/
 /*
- * Estimate the object Kron aperture, using the shape from source.getShape() (e.g. SDSS's adaptive moments)
+ * A cache of sinc aperture coefficients for elliptical apertures, keyed by their quantized shape
+ *
+ * Each aperture's a and b are rounded to the nearest of a set of values spaced by a factor 1 + tolerance,
+ * and theta to the nearest multiple of (about) tolerance radians (or 0 if the quantized a == b).  The
+ * coefficients for the quantized shape are calculated when they're first needed and kept until the total
+ * memory used exceeds the budget, when the least recently used are discarded.  Measuring a flux is then a
+ * sub-pixel shift of the cached coefficients and a dot product with the image.
+ *
+ * The cache is thread safe; lookups only hold the cache's own lock, and calculations hold sincCoeffsMutex.
+ */
+class SincCoeffsCache {
+public:
+    typedef afw::image::Image<float> Image;
+
+    SincCoeffsCache(double const tolerance, // fractional tolerance in a and b when quantizing; > 0
+                    double const maxBytes   // maximum memory to use for coefficients; <= 0: no limit
+                   ) : _logStep(std::log(1.0 + tolerance)),
+                       _nTheta(std::max(1, static_cast<int>(std::ceil(afw::geom::PI/tolerance)))),
+                       _maxBytes(maxBytes), _stats() {}
+
+    /// Measure the flux within the aperture (axes, center), returning the flux and its error
+    ///
+    /// Throw pex::exceptions::LengthError if the aperture's coefficients don't fit in the image
+    template<typename ImageT>
+    std::pair<double, double> measure(ImageT const& image,
+                                      afw::geom::ellipses::Axes const& axes,
+                                      afw::geom::Point2D const& center) {
+        CONST_PTR(Image) const coeffs = afw::math::offsetImage(*_getCoeffs(axes), center.getX(), center.getY(),
+                                                               "lanczos5", 0);
+        afw::geom::Box2I const bbox = coeffs->getBBox();
+        if (!image.getBBox().contains(bbox)) {
+            throw LSST_EXCEPT(pex::exceptions::LengthError,
+                              (boost::format("Sinc coefficients %d,%d--%d,%d don't fit in image %d,%d--%d,%d")
+                               % bbox.getMinX() % bbox.getMinY() % bbox.getMaxX() % bbox.getMaxY()
+                               % image.getBBox().getMinX() % image.getBBox().getMinY()
+                               % image.getBBox().getMaxX() % image.getBBox().getMaxY()).str());
+        }
+
+        double sum = 0.0, sumVar = 0.0;
+        for (int y = 0; y != bbox.getHeight(); ++y) {
+            Image::Pixel const* crow = &*coeffs->row_begin(y);
+            int const row = bbox.getMinY() - image.getY0() + y, x0 = bbox.getMinX() - image.getX0();
+            typename ImageT::Image::Pixel const* irow = &*image.getImage()->row_begin(row) + x0;
+            typename ImageT::Variance::Pixel const* vrow = &*image.getVariance()->row_begin(row) + x0;
+            for (int x = 0; x != bbox.getWidth(); ++x) {
+                sum += crow[x]*irow[x];
+                sumVar += crow[x]*crow[x]*vrow[x];
+            }
+        }
+        return std::make_pair(sum, std::sqrt(sumVar));
+    }
+
+    /// Return the statistics of the cache's use
+    SincCacheStats getStats() const {
+        boost::lock_guard<boost::mutex> lock(_mutex);
+        return _stats;
+    }
+
+private:
+    struct ShapeId {
+        ShapeId(int ia_, int ib_, int itheta_) : ia(ia_), ib(ib_), itheta(itheta_) {}
+        bool operator<(ShapeId const& rhs) const {
+            return (ia != rhs.ia) ? ia < rhs.ia : ((ib != rhs.ib) ? ib < rhs.ib : itheta < rhs.itheta);
+        }
+
+        int ia, ib, itheta;             // quantized a, b, and theta
+    };
+    typedef std::list<ShapeId> ShapeList;
+    struct Entry {
+        CONST_PTR(Image) coeffs;        // the sinc coefficients
+        ShapeList::iterator lru;        // our position in the list of entries ordered by when they were used
+    };
+    typedef std::map<ShapeId, Entry> EntryMap;
+
+    /// Return the coefficients for the quantized version of axes, centred at (0, 0)
+    CONST_PTR(Image) _getCoeffs(afw::geom::ellipses::Axes const& axes) {
+        int const ia = static_cast<int>(std::floor(std::log(axes.getA())/_logStep + 0.5));
+        int const ib = static_cast<int>(std::floor(std::log(axes.getB())/_logStep + 0.5));
+        int itheta = 0;
+        if (ia != ib) {
+            double theta = std::fmod(axes.getTheta(), afw::geom::PI);
+            if (theta < 0) {
+                theta += afw::geom::PI;
+            }
+            itheta = static_cast<int>(std::floor(theta/afw::geom::PI*_nTheta + 0.5)) % _nTheta;
+        }
+        ShapeId const id(ia, ib, itheta);
+        {
+            boost::lock_guard<boost::mutex> lock(_mutex);
+            EntryMap::iterator const ptr = _entries.find(id);
+            if (ptr != _entries.end()) {
+                _lru.splice(_lru.begin(), _lru, ptr->second.lru); // we're the most recently used
+                ++_stats.nHit;
+                return ptr->second.coeffs;
+            }
+            ++_stats.nMiss;
+        }
+
+        afw::geom::ellipses::Axes const quantized(std::exp(ia*_logStep), std::exp(ib*_logStep),
+                                                  itheta*afw::geom::PI/_nTheta);
+        // Don't hold _mutex while calculating, so other threads can use the cached coefficients; but the
+        // calculation itself must be serialised with all the others in the process (FFTW's planner isn't
+        // thread safe)
+        CONST_PTR(Image) coeffs;
+        {
+            boost::lock_guard<boost::mutex> lock(sincCoeffsMutex);
+            coeffs = base::SincCoeffs<float>::calculate(quantized);
+        }
+
+        boost::lock_guard<boost::mutex> lock(_mutex);
+        EntryMap::iterator const ptr = _entries.find(id);
+        if (ptr != _entries.end()) {    // another thread beat us to it
+            return ptr->second.coeffs;
+        }
+        Entry & entry = _entries[id];
+        entry.coeffs = coeffs;
+        entry.lru = _lru.insert(_lru.begin(), id);
+        ++_stats.nEntry;
+        _stats.nBytes += _getBytes(*coeffs);
+        while (_maxBytes > 0 && _stats.nBytes > _maxBytes && _entries.size() > 1) {
+            EntryMap::iterator const oldest = _entries.find(_lru.back());
+            --_stats.nEntry;
+            _stats.nBytes -= _getBytes(*oldest->second.coeffs);
+            _entries.erase(oldest);
+            _lru.pop_back();
+        }
+
+        return coeffs;
+    }
+
+    static double _getBytes(Image const& image) {
+        return static_cast<double>(image.getWidth())*image.getHeight()*sizeof(Image::Pixel);
+    }
+
+    double const _logStep;              // spacing of quantized log(a) and log(b)
+    int const _nTheta;                  // number of quantized values of theta in [0, pi)
+    double const _maxBytes;             // maximum memory to use
+    mutable boost::mutex _mutex;        // protects the following members
+    EntryMap _entries;                  // the coefficients that we've calculated
+    ShapeList _lru;                     // ids of entries, most recently used first
+    SincCacheStats _stats;              // how we've been used
+};
+
+struct KronAperture {
+    KronAperture(afw::geom::Point2D const& center, afw::geom::ellipses::BaseCore const& core) :
+        _center(center), _axes(core) {}
+    explicit KronAperture(afw::table::SourceRecord const& source) :
+        _center(afw::geom::Point2D(source.getX(), source.getY())), _axes(source.getShape()) {}
+    KronAperture(afw::table::SourceRecord const& reference, afw::geom::AffineTransform const& refToMeas,
+                 double radius) :
+        _center(refToMeas(reference.getCentroid())),
+        _axes(_getKronAxes(reference.getShape(), refToMeas.getLinear(), radius))
+        {}
+
+
+    /// Accessors
+    double getX() const { return _center.getX(); }
+    double getY() const { return _center.getY(); }
+    afw::geom::Point2D const& getCenter() const { return _center; }
+    afw::geom::ellipses::Axes & getAxes() { return _axes; }
+    afw::geom::ellipses::Axes const& getAxes() const { return _axes; }
+
+    /// Estimate the Kron Aperture from an image, skipping pixels with any of badBits set
+    /// (the bits of ctrl.badMaskPlanes, which the caller computes once)
+    ///
+    /// If smoother is provided it's used to smooth the image (and ctrl.smoothingSigma is ignored).
+    /// If nIter is provided it's set to the number of iterations used to estimate the radius,
+    /// if radiusErr is provided it's set to the error in the radius (NaN if we smoothed the image),
+    /// and if stats is provided it's updated.
+    ///
+    /// If the first aperture used to estimate the radius doesn't fit in the image and hitEdge is provided,
+    /// *hitEdge is set true and that aperture (which shouldn't be used) is returned; if hitEdge isn't
+    /// provided OutOfRangeError is thrown.  Hitting the edge is common, so callers measuring many sources
+    /// should avoid the throw
+    template<typename ImageT>
+    static KronAperture estimate(ImageT const& image,
+                                 afw::geom::ellipses::Axes axes,
+                                 afw::geom::Point2D const& center,
+                                 KronFluxControl const& ctrl,
+                                 afw::image::MaskPixel const badBits,
+                                 float *radiusForRadius,
+                                 Smoother<typename ImageT::Image::Pixel> *smoother=NULL,
+                                 int *nIter=NULL,
+                                 float *radiusErr=NULL,
+                                 KronFluxStats *stats=NULL,
+                                 bool *hitEdge=NULL
+                                );
+
+    /// Determine the Kron Aperture from an image; as estimate(), but returned on the heap
+    template<typename ImageT>
+    static PTR(KronAperture) determine(ImageT const& image,
+                                       afw::geom::ellipses::Axes axes,
+                                       afw::geom::Point2D const& center,
+                                       KronFluxControl const& ctrl, float *radiusForRadius,
+                                       Smoother<typename ImageT::Image::Pixel> *smoother=NULL
+                                      ) {
+        return boost::make_shared<KronAperture>(estimate(image, axes, center, ctrl,
+                                                         getBadMaskBits(ctrl.badMaskPlanes),
+                                                         radiusForRadius, smoother));
+    }
+
+    /// Photometer within the Kron Aperture on an image
+    ///
+    /// If sincCache is provided it's used to measure sinc apertures; if badBits is non-zero the pixels
+    /// with those mask bits set are skipped (except by the sinc code, which uses all the pixels), and
+    /// if maskedFraction is provided it's set to the fraction of the aperture's pixels with badBits set
+    template<typename ImageT>
+    std::pair<double, double> measure(ImageT const& image, // Image to measure
+                                      double const nRadiusForFlux, // Kron radius multiplier
+                                      double const maxSincRadius, // largest radius that we use sinc apertyres
+                                      SincCoeffsCache *sincCache=NULL, // cache of sinc coefficients, or NULL
+                                      KronFluxStats *stats=NULL,       // statistics to update, or NULL
+                                      afw::image::MaskPixel const badBits=0, // skip pixels with these bits
+                                      double *maskedFraction=NULL // fraction of pixels with badBits, or NULL
+                                     ) const;
+
+    /// The flux in an aperture, which may have failed
+    struct Flux {
+        Flux() : flux(std::numeric_limits<double>::quiet_NaN()),
+                 fluxSigma(std::numeric_limits<double>::quiet_NaN()),
+                 maskedFraction(std::numeric_limits<double>::quiet_NaN()), ok(false) {}
+        Flux(double flux_, double fluxSigma_, double maskedFraction_) :
+            flux(flux_), fluxSigma(fluxSigma_), maskedFraction(maskedFraction_), ok(true) {}
+
+        double flux;                    // the flux
+        double fluxSigma;               // the error in flux
+        double maskedFraction;          // the fraction of the aperture's pixels with badBits set
+        bool ok;                        // was the flux measured successfully?
+    };
+
+    /// Photometer within several multiples of the Kron Aperture on an image; fluxes[i] is set to the flux
+    /// within nRadiusForFlux[i] Kron radii, which must be sorted in increasing order
+    ///
+    /// The apertures that need the sinc code are measured one at a time (and fail if they hit the edge of
+    /// the image); all the others are measured in a single pass over the largest aperture's pixels
+    template<typename ImageT>
+    void measure(ImageT const& image,
+                 std::vector<double> const& nRadiusForFlux,
+                 double const maxSincRadius,
+                 std::vector<Flux> *fluxes,
+                 SincCoeffsCache *sincCache=NULL,
+                 KronFluxStats *stats=NULL,
+                 afw::image::MaskPixel const badBits=0
+                ) const;
+
+    /// Return a Kron Aperture transformed to a different frame
+    KronAperture transformed(afw::geom::AffineTransform const& trans) const {
+        KronAperture result(*this);
+        result._center = trans(_center);
+        result._axes.transform(trans.getLinear()).inPlace();
+        return result;
+    }
+
+    /// Transform a Kron Aperture to a different frame; as transformed(), but returned on the heap
+    PTR(KronAperture) transform(afw::geom::AffineTransform const& trans) const {
+        return boost::make_shared<KronAperture>(transformed(trans));
+    }
+
+private:
+    /// Determine Kron axes from a reference image
+    static
+    afw::geom::ellipses::Axes _getKronAxes(
+        afw::geom::ellipses::Axes const& shape,
+        afw::geom::LinearTransform const& transformation,
+        double const radius
+        );
+
+    afw::geom::Point2D _center;           // Center of aperture
+    afw::geom::ellipses::Axes _axes;      // Ellipse defining aperture shape
+};
+
+
+afw::geom::ellipses::Axes KronAperture::_getKronAxes(
+    afw::geom::ellipses::Axes const& shape,
+    afw::geom::LinearTransform const& transformation,
+    double const radius
+    )
+{
+    afw::geom::ellipses::Axes axes(shape);
+    axes.scale(radius/axes.getDeterminantRadius());
+    return axes.transform(transformation);
+}
+
+
+/*
+ * Estimate the object Kron aperture, using the shape from source.getShape() (e.g. SDSS's adaptive moments)
  */
 template<typename ImageT>
-PTR(KronAperture) KronAperture::determine(ImageT const& image, // Image to measure
-                                          afw::geom::ellipses::Axes axes,  // Axes measured for source
-                                          afw::geom::Point2D const& center, // Centre of source
-                                          KronFluxControl const& ctrl,      // control the algorithm
-                                          float *radiusForRadius            // radius used to estimate radius
-                                         )
+KronAperture KronAperture::estimate(ImageT const& image, // Image to measure
+                                    afw::geom::ellipses::Axes axes,  // Axes measured for source
+                                    afw::geom::Point2D const& center, // Centre of source
+                                    KronFluxControl const& ctrl,      // control the algorithm
+                                    afw::image::MaskPixel const badBits, // skip pixels with these bits
+                                    float *radiusForRadius,           // radius used to estimate radius
+                                    Smoother<typename ImageT::Image::Pixel> *smoother, // how to smooth, or NULL
+                                    int *nIter,                       // number of iterations used, or NULL
+                                    float *radiusErr,                 // error in the radius, or NULL
+                                    KronFluxStats *stats,             // statistics to update, or NULL
+                                    bool *hitEdge                     // did we hit the edge?  or NULL
+                                   )
 {
+    typedef typename ImageT::Image Image;
     //
     // We might smooth the image because this is what SExtractor and Pan-STARRS do.  But I don't see much gain
     //
-    double const sigma = ctrl.smoothingSigma; // Gaussian width of smoothing sigma to apply
-    bool const smoothImage = sigma > 0;
-    int kSize = smoothImage ? 2*int(2*sigma) + 1 : 1;
-    afw::math::GaussianFunction1<afw::math::Kernel::Pixel> gaussFunc(smoothImage ? sigma : 100);
-    afw::math::SeparableKernel kernel(kSize, kSize, gaussFunc, gaussFunc);
-    bool const doNormalize = true, doCopyEdge = false;
-    afw::math::ConvolutionControl convCtrl(doNormalize, doCopyEdge);
+    boost::scoped_ptr<Smoother<typename Image::Pixel> > localSmoother;
+    if (!smoother && ctrl.smoothingSigma > 0) {
+        localSmoother.reset(new Smoother<typename Image::Pixel>(getSmoothingKernel(ctrl.smoothingSigma)));
+        smoother = localSmoother.get();
+    }
+    bool const smoothImage = (smoother != NULL);
     double radius0 = axes.getDeterminantRadius();
     double radius = std::numeric_limits<double>::quiet_NaN();
+    if (nIter) {
+        *nIter = 0;
+    }
+    if (radiusErr) {
+        *radiusErr = std::numeric_limits<float>::quiet_NaN();
+    }
+    if (hitEdge) {
+        *hitEdge = false;
+    }
+    //
+    // Each iteration only rescales the aperture (and R_K only grows), so if ctrl.incrementalRadius
+    // we can add the annulus between the previous aperture and the new one to the previous moments
+    //
+    bool havePrevious = false;          // do we have a previous aperture?
+    EllipseSpans previousSpans(axes, center); // the previous aperture
+    typename FootprintFindMoment<Image>::Moments previousMoments; // the moments within previousSpans
     for (int i = 0; i < ctrl.nIterForRadius; ++i) {
         axes.scale(ctrl.nSigmaForRadius);
         *radiusForRadius = axes.getDeterminantRadius(); // radius we used to estimate R_K
         //
-        // Build an elliptical Footprint of the proper size
+        // Find the pixels in an elliptical aperture of the proper size
         //
-        afw::detection::Footprint foot(afw::geom::ellipses::Ellipse(axes, center));
+        EllipseSpans const spans(axes, center);
+        // Check that the aperture fits before doing any work (FootprintFindMoment would only complain
+        // after we'd smoothed the image)
+        if (!image.getBBox().contains(spans.getBBox())) {
+            if (i == 0) {
+                if (hitEdge) {
+                    *hitEdge = true;
+                    return KronAperture(center, axes);
+                }
+                afw::geom::Box2I const& bbox = spans.getBBox();
+                throw LSST_EXCEPT(lsst::pex::exceptions::OutOfRangeError,
+                                  (boost::format("Determining Kron aperture: aperture %d,%d--%d,%d "
+                                                 "doesn't fit in image")
+                                   % bbox.getMinX() % bbox.getMinY() % bbox.getMaxX() % bbox.getMaxY()).str());
+            }
+            break;                      // use the radius we have
+        }
+        // If we're not smoothing we can use the whole image, as FootprintFindMoment checks that the
+        // aperture lies within it
         afw::geom::Box2I bbox = !smoothImage ?
-            foot.getBBox() :
-            kernel.growBBox(foot.getBBox()); // the smallest bbox needed to convolve with Kernel
+            spans.getBBox() :
+            smoother->getKernel().growBBox(spans.getBBox()); // the smallest bbox needed to convolve with Kernel
         bbox.clip(image.getBBox());
-        ImageT subImage(image, bbox, afw::image::PARENT, smoothImage);
-        if (smoothImage) {
-            afw::math::convolve(subImage, ImageT(image, bbox, afw::image::PARENT, false), kernel, convCtrl);
-        }
+        Image const subImage = (!smoothImage || bbox.isEmpty()) ?
+            *image.getImage() :
+            smoothRegion(smoother, *image.getImage(), bbox, stats ? &stats->smoothingTime : NULL,
+                         i + 1 < ctrl.nIterForRadius); // only pad if there may be a larger aperture
         //
         // Find the desired first moment of the elliptical radius, which corresponds to the major axis.
         //
-        FootprintFindMoment<ImageT, afw::detection::Psf::Image> iRFunctor(
-            subImage, center, axes.getA()/axes.getB(), axes.getTheta()
-        );
+        // The variance plane isn't smoothed, so we only know the variance of <r> for the raw image
+        FootprintFindMoment<Image> iRFunctor(subImage, center, axes.getA()/axes.getB(), axes.getTheta(),
+                                             ctrl.floatRadiusMoments,
+                                             (radiusErr && !smoothImage) ? image.getVariance().get() : NULL,
+                                             image.getMask().get(), badBits);
 
         try {
-            iRFunctor.apply(foot);
+            StageTimer timer(stats ? &stats->radiusTime : NULL);
+            if (ctrl.incrementalRadius && havePrevious) {
+                iRFunctor.applyAnnulus(previousSpans, previousMoments, spans);
+            } else {
+                iRFunctor.apply(spans);
+            }
         } catch(lsst::pex::exceptions::OutOfRangeError &e) {
             if (i == 0) {
                 LSST_EXCEPT_ADD(e, "Determining Kron aperture");
@@ -330,78 +1441,796 @@ PTR(KronAperture) KronAperture::determine(ImageT const& image, // Image to measu
             break;                      // use the radius we have
         }
 
+        if (nIter) {
+            *nIter = i + 1;
+        }
+        if (stats) {
+            ++stats->nIter;
+        }
+        if (ctrl.incrementalRadius) {
+            havePrevious = true;
+            previousSpans = spans;
+            previousMoments = iRFunctor.getMoments();
+        }
         if (!iRFunctor.getGood()) {
             throw LSST_EXCEPT(BadKronException, "Bad integral defining Kron radius");
         }
 
-        radius = iRFunctor.getIr()*sqrt(axes.getB()/axes.getA());
-        if (radius <= radius0) {
-            break;
+        radius = iRFunctor.getIr()*sqrt(axes.getB()/axes.getA());
+        if (radius <= radius0) {
+            break;
+        }
+        if (radiusErr) {
+            *radiusErr = ::sqrt(iRFunctor.getIrVar()*axes.getB()/axes.getA());
+        }
+        // Has R_K converged? (on the first iteration radius0 is the input shape's radius, not an R_K)
+        bool const converged = (i > 0 && (radius - radius0) < ctrl.radiusTolerance*radius);
+        radius0 = radius;
+
+        axes.scale(radius/axes.getDeterminantRadius()); // set axes to our current estimate of R_K
+        if (converged) {
+            break;
+        }
+    }
+
+    return KronAperture(center, axes);
+}
+
+// Return true unless the aperture (axes, center) certainly can't be measured with the sinc code on an
+// image with bounding box bbox; the coefficients extend beyond the aperture, so even if it fits they may not
+bool sincApertureMayFit(afw::geom::Box2I const& bbox, afw::geom::ellipses::Axes const& axes,
+                        afw::geom::Point2D const& center)
+{
+    return bbox.contains(EllipseSpans(axes, center).getBBox());
+}
+
+// Return the fraction of the pixels of the aperture spans that lie within mask and have any of badBits set;
+// only needed for sinc apertures, as FootprintFlux counts the masked pixels as it skips them
+template<typename MaskT>
+double getMaskedFraction(MaskT const& mask, EllipseSpans const& spans, afw::image::MaskPixel const badBits)
+{
+    afw::geom::Box2I const bbox = mask.getBBox();
+    long nPixel = 0, nMasked = 0;
+    for (int y = spans.getMinY(); y <= spans.getMaxY(); ++y) {
+        int x0, x1;
+        if (spans.getSpan(y, bbox, &x0, &x1)) {
+            typename MaskT::Pixel const* mrow = &*mask.row_begin(y - mask.getY0()) + (x0 - mask.getX0());
+            int const n = x1 - x0 + 1;
+            for (int i = 0; i != n; ++i) {
+                if (mrow[i] & badBits) {
+                    ++nMasked;
+                }
+            }
+            nPixel += n;
+        }
+    }
+    return (nPixel == 0) ? 0.0 : static_cast<double>(nMasked)/nPixel;
+}
+
+// Photometer an image with a particular aperture
+//
+// The aperture's passed as its axes and centre, as we only need to build an (allocating) Ellipse for the
+// sinc code (and not even then if we have a cache of sinc coefficients).  If maskedFraction is provided
+// it's set to the fraction of the aperture's pixels with any of badBits set
+template<typename ImageT>
+std::pair<double, double> photometer(
+    ImageT const& image, // Image to measure
+    afw::geom::ellipses::Axes const& axes, // Shape of aperture in which to measure
+    afw::geom::Point2D const& center,      // Centre of aperture
+    double const maxSincRadius, // largest radius that we use sinc apertures to measure
+    SincCoeffsCache *sincCache=NULL, // cache of sinc coefficients, or NULL
+    KronFluxStats *stats=NULL,       // statistics to update, or NULL
+    afw::image::MaskPixel const badBits=0, // skip pixels with these mask bits set (not for sinc apertures)
+    double *maskedFraction=NULL            // the fraction of pixels with badBits set, or NULL
+    )
+{
+    if (axes.getB() > maxSincRadius) {
+        StageTimer timer(stats ? &stats->naiveTime : NULL);
+        if (stats) {
+            ++stats->nNaive;
+        }
+        FootprintFlux<ImageT> fluxFunctor(image, badBits);
+        fluxFunctor.apply(EllipseSpans(axes, center));
+        if (maskedFraction) {
+            *maskedFraction = fluxFunctor.getMaskedFraction();
+        }
+
+        return std::make_pair(fluxFunctor.getSum(), ::sqrt(fluxFunctor.getSumVar()));
+    }
+    StageTimer timer(stats ? &stats->sincTime : NULL);
+    if (stats) {
+        ++stats->nSinc;
+    }
+    try {
+        if (!sincApertureMayFit(image.getBBox(), axes, center)) { // don't bother calculating coefficients
+            throw LSST_EXCEPT(pex::exceptions::LengthError, "Sinc aperture doesn't fit in image");
+        }
+        if (maskedFraction) {
+            *maskedFraction = badBits ?
+                getMaskedFraction(*image.getMask(), EllipseSpans(axes, center), badBits) : 0.0;
+        }
+        if (sincCache) {
+            return sincCache->measure(image, axes, center);
+        }
+        afw::geom::ellipses::Ellipse const aperture(axes, center);
+        // computeSincFlux calculates the coefficients unless meas_base has them cached, and we can't tell
+        // which it'll do, so hold the lock for all of it; use a SincCoeffsCache to avoid serialising
+        boost::lock_guard<boost::mutex> lock(sincCoeffsMutex);
+        base::ApertureFluxResult fluxResult =
+            base::ApertureFluxAlgorithm::computeSincFlux<typename ImageT::Image::Pixel>(image, aperture);
+        return std::make_pair(fluxResult.flux, fluxResult.fluxSigma);
+    } catch(pex::exceptions::LengthError &e) {
+        LSST_EXCEPT_ADD(e, (boost::format("Measuring Kron flux for object at (%.3f, %.3f);"
+                                          " aperture radius %g,%g theta %g")
+                            % center.getX() % center.getY()
+                            % axes.getA() % axes.getB() % afw::geom::radToDeg(axes.getTheta())).str());
+        throw e;
+    }
+}
+
+
+double calculatePsfKronRadius(
+    CONST_PTR(afw::detection::Psf) const& psf, // PSF to measure
+    afw::geom::Point2D const& center, // Centroid of source on parent image
+    double smoothingSigma=0.0         // Gaussian sigma of smoothing applied
+    )
+{
+    assert(psf);
+    double const radius = psf->computeShape(center).getDeterminantRadius();
+    // For a Gaussian N(0, sigma^2), the Kron radius is sqrt(pi/2)*sigma
+    return ::sqrt(afw::geom::PI/2)*::hypot(radius, std::max(0.0, smoothingSigma));
+}
+
+/************************************************************************************************************/
+/*
+ * A cache of the PSF's Kron radius, evaluated on a grid of positions and bilinearly interpolated
+ *
+ * The nodes are spread evenly over the image, no more than the requested spacing apart, with the first
+ * and last on its edges, so we never evaluate the PSF outside the image (where e.g. a CoaddPsf may be
+ * undefined).  The grid's nodes are evaluated the first time that they're needed.  The cache is reset
+ * whenever it's asked about a different PSF or image; as we hold a pointer to the PSF it can't be
+ * replaced by a different PSF at the same address behind our backs.
+ */
+class PsfKronRadiusCache {
+public:
+    PsfKronRadiusCache(int const spacing,         // spacing of grid, pixels
+                       double const smoothingSigma // Gaussian sigma of smoothing applied
+                      ) : _spacing(spacing), _smoothingSigma(smoothingSigma), _psf(), _bbox(),
+                          _nx(0), _ny(0), _dx(1.0), _dy(1.0) {}
+
+    /// Return the Kron radius of psf at center, which is (usually) in bbox
+    double operator()(CONST_PTR(afw::detection::Psf) const& psf, afw::geom::Box2I const& bbox,
+                      afw::geom::Point2D const& center) {
+        boost::lock_guard<boost::mutex> lock(_mutex);
+        if (psf != _psf || bbox != _bbox) {
+            _reset(psf, bbox);
+        }
+        // Position of center in units of grid cells, clamped to lie within the grid
+        double const u = std::min(std::max((center.getX() - _bbox.getMinX())/_dx, 0.0), _nx - 1.0);
+        double const v = std::min(std::max((center.getY() - _bbox.getMinY())/_dy, 0.0), _ny - 1.0);
+        int const ix = std::min(static_cast<int>(u), std::max(_nx - 2, 0));
+        int const iy = std::min(static_cast<int>(v), std::max(_ny - 2, 0));
+        double const du = u - ix, dv = v - iy;
+
+        double value = (1 - du)*(1 - dv)*_getNode(ix, iy);
+        if (du > 0) {
+            value += du*(1 - dv)*_getNode(ix + 1, iy);
+        }
+        if (dv > 0) {
+            value += (1 - du)*dv*_getNode(ix, iy + 1);
+            if (du > 0) {
+                value += du*dv*_getNode(ix + 1, iy + 1);
+            }
+        }
+        return value;
+    }
+
+private:
+    void _reset(CONST_PTR(afw::detection::Psf) const& psf, afw::geom::Box2I const& bbox) {
+        _psf = psf;
+        _bbox = bbox;
+        // the fewest nodes no more than _spacing apart that reach from one edge of bbox to the other
+        int const width = std::max(bbox.getWidth() - 1, 0), height = std::max(bbox.getHeight() - 1, 0);
+        _nx = 1 + (width + _spacing - 1)/_spacing;
+        _ny = 1 + (height + _spacing - 1)/_spacing;
+        _dx = (_nx > 1) ? static_cast<double>(width)/(_nx - 1) : 1.0;
+        _dy = (_ny > 1) ? static_cast<double>(height)/(_ny - 1) : 1.0;
+        _nodes.assign(_nx*_ny, -1.0);
+    }
+
+    double _getNode(int const ix, int const iy) {
+        double & value = _nodes[iy*_nx + ix];
+        if (value < 0) {
+            // Put the last nodes exactly on the far edges of _bbox, whatever the rounding in i*_d
+            afw::geom::Point2D const position(ix == _nx - 1 ? _bbox.getMaxX() : _bbox.getMinX() + ix*_dx,
+                                              iy == _ny - 1 ? _bbox.getMaxY() : _bbox.getMinY() + iy*_dy);
+            value = calculatePsfKronRadius(_psf, position, _smoothingSigma);
+        }
+        return value;
+    }
+
+    int const _spacing;                 // spacing of grid nodes, pixels
+    double const _smoothingSigma;       // Gaussian sigma of smoothing applied
+    boost::mutex _mutex;                // protects all the following members
+    CONST_PTR(afw::detection::Psf) _psf; // the PSF we're caching
+    afw::geom::Box2I _bbox;             // the image that the grid covers
+    int _nx, _ny;                       // number of grid nodes in x and y
+    double _dx, _dy;                    // spacing of grid nodes in x and y; <= _spacing
+    std::vector<double> _nodes;         // the PSF Kron radius at the grid nodes (< 0: not yet evaluated)
+};
+
+/************************************************************************************************************/
+/*
+ * A cache of the transform from the pixels of a reference image to those of an exposure
+ *
+ * measureForced is usually called with the same exposure and reference Wcs for every source in a
+ * catalog, so we keep the XYTransformFromWcsPair (and the copy of the reference Wcs that it needs) until
+ * we're asked about a different pair.  We hold a pointer to the exposure's Wcs, so it can't be replaced
+ * by a different Wcs at the same address; the reference Wcs is passed by reference, so we check that
+ * the one at the cached address is still the same.
+ */
+class WcsPairCache {
+public:
+    WcsPairCache() : _wcs(), _refWcsAddress(NULL), _refWcs(), _transform() {}
+
+    /// Return the local transform from refWcs's pixels to wcs's at refPosition
+    afw::geom::AffineTransform operator()(CONST_PTR(afw::image::Wcs) const& wcs,
+                                          afw::image::Wcs const& refWcs,
+                                          afw::geom::Point2D const& refPosition) {
+        boost::lock_guard<boost::mutex> lock(_mutex);
+        if (!_transform || wcs != _wcs || &refWcs != _refWcsAddress || !(*_refWcs == refWcs)) {
+            _wcs = wcs;
+            _refWcsAddress = &refWcs;
+            _refWcs = refWcs.clone();
+            _transform.reset(new afw::image::XYTransformFromWcsPair(_wcs, _refWcs));
+        }
+        return _transform->linearizeForwardTransform(refPosition);
+    }
+
+private:
+    boost::mutex _mutex;                           // protects the following members
+    CONST_PTR(afw::image::Wcs) _wcs;               // the exposure's Wcs
+    afw::image::Wcs const* _refWcsAddress;         // the address of the reference Wcs we were passed
+    CONST_PTR(afw::image::Wcs) _refWcs;            // our copy of the reference Wcs
+    boost::scoped_ptr<afw::image::XYTransformFromWcsPair> _transform; // the transform from _refWcs to _wcs
+};
+
+/*
+ * A cache of the key for a field in the schema of reference records
+ *
+ * _applyForced needs our radius from every reference record, but they almost always all come from the
+ * same table, so we only search the schema when we see a new one.  We hold a pointer to the table, so it
+ * can't be replaced by a different table at the same address.
+ */
+class ReferenceKeyCache {
+public:
+    explicit ReferenceKeyCache(std::string const& name // name of field
+                              ) : _name(name), _table(), _key() {}
+
+    /// Return the key for our field in reference's schema
+    afw::table::Key<float> operator()(afw::table::SourceRecord const& reference) {
+        boost::lock_guard<boost::mutex> lock(_mutex);
+        if (reference.getTable() != _table) {
+            _key = reference.getSchema().find<float>(_name).key;
+            _table = reference.getTable();
+        }
+        return _key;
+    }
+
+private:
+    std::string const _name;                       // name of field
+    boost::mutex _mutex;                           // protects the following members
+    CONST_PTR(afw::table::BaseTable) _table;       // the table that _key belongs to
+    afw::table::Key<float> _key;                   // the key for our field in _table's schema
+};
+
+template<typename ImageT>
+std::pair<double, double> KronAperture::measure(ImageT const& image, // Image of interest
+                                                double const nRadiusForFlux, // Kron radius multiplier
+                                                double const maxSincRadius, // largest radius that we use sinc
+                                                                            // apertures to measure
+                                                SincCoeffsCache *sincCache, // cache of sinc coefficients
+                                                KronFluxStats *stats,       // statistics to update
+                                                afw::image::MaskPixel const badBits, // mask bits to skip
+                                                double *maskedFraction // fraction of pixels with badBits
+                                               ) const
+{
+    afw::geom::ellipses::Axes axes(getAxes()); // Copy of ellipse core, so we can scale
+    axes.scale(nRadiusForFlux);
+
+    return photometer(image, axes, getCenter(), maxSincRadius, sincCache, stats, badBits, maskedFraction);
+}
+
+template<typename ImageT>
+void KronAperture::measure(ImageT const& image, // Image of interest
+                           std::vector<double> const& nRadiusForFlux, // sorted Kron radius multipliers
+                           double const maxSincRadius, // largest radius that we use sinc apertures to measure
+                           std::vector<Flux> *fluxes,  // the fluxes in each aperture
+                           SincCoeffsCache *sincCache, // cache of sinc coefficients
+                           KronFluxStats *stats,       // statistics to update
+                           afw::image::MaskPixel const badBits // skip pixels with these mask bits set
+                          ) const
+{
+    std::size_t const n = nRadiusForFlux.size();
+    fluxes->resize(n);
+    //
+    // The small apertures are measured one at a time using sinc apertures
+    //
+    std::size_t i = 0;
+    for (; i != n && getAxes().getB()*nRadiusForFlux[i] <= maxSincRadius; ++i) {
+        afw::geom::ellipses::Axes axes(getAxes());
+        axes.scale(nRadiusForFlux[i]);
+        if (!sincApertureMayFit(image.getBBox(), axes, getCenter())) {
+            (*fluxes)[i] = Flux();
+            continue;
+        }
+        try {
+            double maskedFraction = 0.0;
+            std::pair<double, double> const result = measure(image, nRadiusForFlux[i], maxSincRadius,
+                                                               sincCache, stats, badBits, &maskedFraction);
+            (*fluxes)[i] = Flux(result.first, result.second, maskedFraction);
+        } catch (pex::exceptions::LengthError &) {
+            (*fluxes)[i] = Flux();
+        }
+    }
+    //
+    // and the rest all at once
+    //
+    std::vector<EllipseSpans> apertures;
+    apertures.reserve(n - i);
+    for (std::size_t j = i; j != n; ++j) {
+        afw::geom::ellipses::Axes axes(getAxes());
+        axes.scale(nRadiusForFlux[j]);
+        apertures.push_back(EllipseSpans(axes, getCenter()));
+    }
+    StageTimer timer(stats ? &stats->naiveTime : NULL);
+    if (stats) {
+        stats->nNaive += apertures.size();
+    }
+    std::vector<double> sums, sumVars, maskedFractions;
+    FootprintFlux<ImageT> fluxFunctor(image, badBits);
+    fluxFunctor.apply(apertures, &sums, &sumVars, &maskedFractions);
+    for (std::size_t j = 0; j != apertures.size(); ++j) {
+        (*fluxes)[i + j] = Flux(sums[j], ::sqrt(sumVars[j]), maskedFractions[j]);
+    }
+}
+
+/************************************************************************************************************/
+/*
+ * The statistics of all the measurements made by an algorithm; thread safe
+ */
+class KronFluxStatsCollector {
+public:
+    KronFluxStatsCollector() : _total() {}
+
+    void add(KronFluxStats const& stats) {
+        boost::lock_guard<boost::mutex> lock(_mutex);
+        _total += stats;
+    }
+
+    KronFluxStats get() const {
+        boost::lock_guard<boost::mutex> lock(_mutex);
+        return _total;
+    }
+
+    void reset() {
+        boost::lock_guard<boost::mutex> lock(_mutex);
+        _total = KronFluxStats();
+    }
+
+private:
+    mutable boost::mutex _mutex;        // protects _total
+    KronFluxStats _total;               // the statistics
+};
+
+namespace {
+/*
+ * Statistics gathered by a single thread, which are added to a collector when we go out of scope
+ */
+class LocalStats : boost::noncopyable {
+public:
+    explicit LocalStats(KronFluxStatsCollector *collector // where to add our statistics; may be NULL
+                       ) : _collector(collector), _stats() {}
+    ~LocalStats() {
+        if (_collector) {
+            _collector->add(_stats);
+        }
+    }
+
+    /// Return the statistics to update, or NULL if we aren't collecting them
+    KronFluxStats *get() { return _collector ? &_stats : NULL; }
+
+private:
+    KronFluxStatsCollector *const _collector;
+    KronFluxStats _stats;
+};
+
+int const SINC_BORDER = 5;              // how far beyond its aperture we assume a sinc aperture reaches
+
+/*
+ * Thrown when measuring a source on part of an exposure would need pixels that we haven't read
+ *
+ * Deliberately not a pex::exceptions::Exception, so it isn't mistaken for a measurement failure
+ */
+class RegionTooSmallError : public std::exception {
+public:
+    explicit RegionTooSmallError(afw::geom::Box2I const& bbox // the pixels that we need
+                                ) : _bbox(bbox) {}
+
+    virtual char const* what() const throw() { return "Region too small to measure Kron flux"; }
+
+    /// Return the pixels that we need
+    afw::geom::Box2I const& getBBox() const { return _bbox; }
+
+private:
+    afw::geom::Box2I _bbox;
+};
+
+/*
+ * Return the pixels needed to measure a source's radius (using apertures shaped like radiusAxes, the
+ * largest of which had a radius radiusForRadius; NaN if we didn't measure R_K) and then its fluxes in
+ * the nRadiusForFlux multiples of aperture
+ *
+ * We don't know exactly how far the sinc coefficients extend beyond their aperture, so we assume
+ * SINC_BORDER; if that's not enough the fluxes will fail with EDGE and we'll try again with more pixels
+ */
+afw::geom::Box2I getRegionNeeded(
+    afw::geom::Point2D const& center,                    // centre of radius apertures
+    afw::geom::ellipses::Axes const& radiusAxes,         // shape of radius apertures
+    double const radiusForRadius,                        // radius of largest radius aperture, or NaN
+    CONST_PTR(afw::math::SeparableKernel) const& kernel, // kernel used to smooth; may be null
+    KronAperture const& aperture,                        // the Kron aperture
+    std::vector<double> const& nRadiusForFlux,           // the numbers of Kron radii that we measure
+    double const maxSincRadius                           // largest sinc aperture
+    )
+{
+    afw::geom::Box2I needed;
+    if (radiusForRadius > 0) {
+        afw::geom::ellipses::Axes axes(radiusAxes);
+        axes.scale(radiusForRadius/axes.getDeterminantRadius());
+        afw::geom::Box2I const bbox = EllipseSpans(axes, center).getBBox();
+        needed.include(kernel ? kernel->growBBox(bbox) : bbox);
+    }
+    for (std::size_t i = 0; i != nRadiusForFlux.size(); ++i) {
+        afw::geom::ellipses::Axes axes(aperture.getAxes());
+        axes.scale(nRadiusForFlux[i]);
+        afw::geom::Box2I bbox = EllipseSpans(axes, aperture.getCenter()).getBBox();
+        if (axes.getB() <= maxSincRadius) {
+            bbox.grow(SINC_BORDER);
+        }
+        needed.include(bbox);
+    }
+    return needed;
+}
+
+/*
+ * Return the part of exposure in region with the pixels replaced by noise drawn from its variance plane,
+ * and then the pixels of heavy inserted
+ */
+afw::image::Exposure<float> makeChildExposure(
+    afw::image::Exposure<float> const& exposure,          // the exposure containing the child
+    afw::detection::HeavyFootprint<float> const& heavy,   // the child's pixels
+    afw::geom::Box2I const& region,                       // the part of exposure that we need
+    afw::math::Random & rand                              // generator for the noise
+    )
+{
+    afw::image::MaskedImage<float> mimage(exposure.getMaskedImage(), region, afw::image::PARENT, true);
+    afw::image::Image<float> & image = *mimage.getImage();
+    afw::image::Image<afw::image::VariancePixel> const& variance = *mimage.getVariance();
+    for (int y = 0; y != image.getHeight(); ++y) {
+        afw::image::Image<afw::image::VariancePixel>::const_x_iterator vptr = variance.row_begin(y);
+        for (afw::image::Image<float>::x_iterator ptr = image.row_begin(y), end = image.row_end(y);
+             ptr != end; ++ptr, ++vptr) {
+            *ptr = ::sqrt(std::max(static_cast<double>(*vptr), 0.0))*rand.gaussian();
+        }
+    }
+    heavy.insert(mimage);
+
+    afw::image::Exposure<float> child(mimage, exposure.getWcs());
+    child.setPsf(exposure.getPsf());
+    return child;
+}
+} // end anonymous namespace
+
+/*
+ * The sources that couldn't be measured on part of an exposure, and the pixels that each needs; thread safe
+ */
+class DeferredSources {
+public:
+    typedef std::map<afw::table::SourceRecord const*, afw::geom::Box2I> Map;
+
+    DeferredSources() : _sources() {}
+
+    /// Remember that source needs the pixels in bbox
+    void add(afw::table::SourceRecord const& source, afw::geom::Box2I const& bbox) {
+        boost::lock_guard<boost::mutex> lock(_mutex);
+        _sources[&source] = bbox;
+    }
+
+    /// Return the deferred sources and the pixels that they need
+    Map const& get() const { return _sources; }
+
+private:
+    boost::mutex _mutex;                // protects _sources
+    Map _sources;                       // the deferred sources
+};
+
+/************************************************************************************************************/
+/*
+ * The state that's shared by all the sources measured on a single Exposure
+ */
+template<typename PixelT>
+struct KronFluxAlgorithm::ExposureContext {
+    /// If deferred is non-NULL the exposure is only part of an image with bounding box fullBBox, and the
+    /// sources that need pixels that we don't have are added to deferred rather than being measured
+    ExposureContext(afw::image::Exposure<PixelT> const& exposure_, KronFluxControl const& ctrl,
+                    afw::geom::Box2I const& fullBBox_=afw::geom::Box2I(), DeferredSources *deferred_=NULL) :
+        exposure(exposure_),
+        mimage(exposure_.getMaskedImage()),
+        psf(exposure_.getPsf()),
+        kernel(getSmoothingKernel(ctrl.smoothingSigma)),
+        fullBBox(fullBBox_.isEmpty() ? exposure_.getBBox() : fullBBox_),
+        deferred(deferred_),
+        _havePsfShape(false)
+        {}
+
+    /// Throw RegionTooSmallError if we're not measuring all of the image and don't have all of needed
+    void checkRegion(afw::geom::Box2I needed) const {
+        if (deferred) {
+            afw::geom::Box2I const required = needed;
+            needed.clip(fullBBox);  // the pixels outside the image don't exist, so we can't need them
+            if (!exposure.getBBox().contains(needed)) {
+                throw RegionTooSmallError(required);
+            }
+        }
+    }
+
+    /// Return the PSF's shape at the average position; only valid if psf is non-null
+    ///
+    /// The result is cached, so the first call mustn't be made while other threads may be calling this
+    afw::geom::ellipses::Axes const& getPsfShape() const {
+        if (!_havePsfShape) {
+            _psfShape = psf->computeShape();
+            _havePsfShape = true;
+        }
+        return _psfShape;
+    }
+
+    afw::image::Exposure<PixelT> const& exposure;   // the Exposure being measured
+    afw::image::MaskedImage<PixelT> const& mimage;  // the Exposure's pixels
+    CONST_PTR(afw::detection::Psf) const psf;       // the Exposure's PSF; may be null
+    CONST_PTR(afw::math::SeparableKernel) const kernel; // kernel to smooth with when finding R_K; may be null
+    PTR(SmoothedImageCache<PixelT>) smoothedImageCache; // the image smoothed with kernel; may be null
+    afw::geom::Box2I const fullBBox;                // the bounding box of the whole image
+    DeferredSources *const deferred;                // where to put sources that need more pixels; may be NULL
+private:
+    mutable bool _havePsfShape;                     // have we evaluated _psfShape?
+    mutable afw::geom::ellipses::Axes _psfShape;    // the PSF's shape at the average position
+};
+
+/*
+ * Scratch space used while measuring sources; each thread needs its own
+ */
+template<typename PixelT>
+struct KronFluxAlgorithm::Workspace {
+    Workspace(ExposureContext<PixelT> const& context,
+              KronFluxStatsCollector *collector // where to add our statistics; may be NULL
+             ) :
+        smoother(context.kernel ? new Smoother<PixelT>(context.kernel, context.smoothedImageCache) : NULL),
+        stats(collector)
+        {}
+
+    boost::scoped_ptr<Smoother<PixelT> > smoother; // NULL if we're not smoothing
+    LocalStats stats;                             // statistics of the measurements in this thread
+};
+
+/*
+ * Measure the sources in a catalog, one chunk at a time; operator() may be run in several threads at once
+ *
+ * Everything that uses the PSF (which caches its images, so isn't thread safe) is evaluated serially in
+ * measureCatalog before the workers start.  The workers only write to the records they're measuring, and
+ * each record is measured by a single thread; as no two records share storage the FlagHandler needs no
+ * locking.  Sinc coefficients are calculated using FFTW, whose planner isn't thread safe, so their
+ * calculation is serialised by sincCoeffsMutex.
+ */
+template<typename PixelT>
+class KronFluxAlgorithm::CatalogWorker {
+public:
+    /// The per-source quantities evaluated before the workers start, as arrays indexed by catalog position
+    struct SourceBatch {
+        explicit SourceBatch(std::size_t const n) : x(n), y(n), R_K_psf(n, -1), order() {
+            order.reserve(n);
+        }
+
+        /// Sort order into spatial order, so that sources measured together (by one thread, in turn) use
+        /// neighbouring pixels
+        void sortByPosition(afw::geom::Box2I const& bbox) {
+            std::vector<std::pair<boost::uint32_t, std::size_t> > keys;
+            keys.reserve(order.size());
+            for (std::size_t j = 0; j != order.size(); ++j) {
+                std::size_t const i = order[j];
+                keys.push_back(std::make_pair(getMortonKey((x[i] - bbox.getMinX())/LOCALITY_CELL,
+                                                           (y[i] - bbox.getMinY())/LOCALITY_CELL), i));
+            }
+            std::sort(keys.begin(), keys.end()); // the catalog's order breaks ties, so this is deterministic
+            for (std::size_t j = 0; j != keys.size(); ++j) {
+                order[j] = keys[j].second;
+            }
+        }
+
+        std::vector<double> x, y;       // centroids of sources
+        std::vector<double> R_K_psf;    // Kron radius of PSF at centroid, or -1 if there's no PSF
+        std::vector<std::size_t> order; // the sources that haven't already failed, in the order to measure
+    };
+
+    CatalogWorker(KronFluxAlgorithm const& algorithm, afw::table::SourceCatalog & catalog,
+                  ExposureContext<PixelT> const& context, SourceBatch const& batch) :
+        _algorithm(algorithm), _catalog(catalog), _context(context), _batch(batch),
+        _next(0), _abort(false)
+        {}
+
+    /// Measure chunks of the catalog until there are none left
+    void operator()() {
+        try {
+            Workspace<PixelT> workspace(_context, _algorithm._statsCollector.get());
+            std::size_t begin, end;
+            while (_getChunk(&begin, &end)) {
+                for (std::size_t j = begin; j != end; ++j) {
+                    std::size_t const i = _batch.order[j];
+                    afw::geom::Point2D const center(_batch.x[i], _batch.y[i]);
+                    _algorithm._measureOrFail(_catalog[i], _context, workspace, center, _batch.R_K_psf[i]);
+                }
+            }
+        } catch (meas::base::FatalAlgorithmError & e) {
+            boost::lock_guard<boost::mutex> lock(_mutex);
+            if (!_fatalError && !_otherError) {
+                _fatalError = boost::make_shared<meas::base::FatalAlgorithmError>(e);
+            }
+            _abort = true;
+        } catch (std::exception & e) {
+            boost::lock_guard<boost::mutex> lock(_mutex);
+            if (!_fatalError && !_otherError) {
+                _otherError = boost::make_shared<pex::exceptions::RuntimeError>(
+                    LSST_EXCEPT(pex::exceptions::RuntimeError, e.what()));
+            }
+            _abort = true;
+        }
+    }
+
+    /// Rethrow the first unrecoverable error seen by any of the threads
+    void rethrow() const {
+        if (_fatalError) {
+            throw *_fatalError;
+        } else if (_otherError) {
+            throw *_otherError;
+        }
+    }
+
+private:
+    static std::size_t const CHUNK_SIZE = 16; // number of sources to measure in each chunk
+    static int const LOCALITY_CELL = 64;      // size of the cells (pixels) used to sort sources spatially
+
+    /// Return the Z-order (Morton) key of the cell (u, v), clamped to [0, 65535] (NaN maps to 0)
+    static boost::uint32_t getMortonKey(double const u, double const v) {
+        boost::uint32_t const iu = static_cast<boost::uint32_t>((u > 0) ? std::min(u, 65535.0) : 0.0);
+        boost::uint32_t const iv = static_cast<boost::uint32_t>((v > 0) ? std::min(v, 65535.0) : 0.0);
+        boost::uint32_t key = 0;
+        for (int b = 0; b != 16; ++b) {
+            key |= ((iu >> b) & 1) << (2*b);
+            key |= ((iv >> b) & 1) << (2*b + 1);
         }
-        radius0 = radius;
+        return key;
+    }
 
-        axes.scale(radius/axes.getDeterminantRadius()); // set axes to our current estimate of R_K
+    bool _getChunk(std::size_t *begin, std::size_t *end) {
+        boost::lock_guard<boost::mutex> lock(_mutex);
+        if (_abort || _next >= _batch.order.size()) {
+            return false;
+        }
+        *begin = _next;
+        _next = std::min(_next + CHUNK_SIZE, _batch.order.size());
+        *end = _next;
+        return true;
     }
 
-    return boost::make_shared<KronAperture>(center, axes);
+    KronFluxAlgorithm const& _algorithm;
+    afw::table::SourceCatalog & _catalog;
+    ExposureContext<PixelT> const& _context;
+    SourceBatch const& _batch;
+    boost::mutex _mutex;                // protects the following members
+    std::size_t _next;                  // index of the next source to measure
+    bool _abort;                        // stop measuring
+    PTR(meas::base::FatalAlgorithmError) _fatalError; // the first FatalAlgorithmError seen
+    PTR(pex::exceptions::RuntimeError) _otherError;   // the first other unrecoverable error seen
+};
+
+/************************************************************************************************************/
+
+namespace {
+/*
+ * The header of a KronApertureStore's file
+ */
+struct KronApertureStoreHeader {
+    char magic[8];                      // APERTURE_STORE_MAGIC
+    boost::int64_t nEntry;              // number of KronApertureEntries that follow
+};
+
+char const APERTURE_STORE_MAGIC[8] = {'K', 'R', 'O', 'N', 'A', 'P', '0', '1'};
+
+bool compareEntryIds(KronApertureEntry const& lhs, KronApertureEntry const& rhs) {
+    return lhs.id < rhs.id;
 }
+} // end anonymous namespace
 
-// Photometer an image with a particular aperture
-template<typename ImageT>
-std::pair<double, double> photometer(
-    ImageT const& image, // Image to measure
-    afw::geom::ellipses::Ellipse const& aperture, // Aperture in which to measure
-    double const maxSincRadius // largest radius that we use sinc apertures to measure
-    )
+KronApertureStore::KronApertureStore(std::string const& fileName) : _map(NULL), _mapSize(0),
+                                                                    _begin(NULL), _end(NULL)
 {
-    afw::geom::ellipses::Axes const& axes = aperture.getCore();
-    if (axes.getB() > maxSincRadius) {
-        FootprintFlux<ImageT> fluxFunctor(image);
-        afw::detection::Footprint const foot(aperture, image.getBBox());
-        fluxFunctor.apply(foot);
-
-        return std::make_pair(fluxFunctor.getSum(), ::sqrt(fluxFunctor.getSumVar()));
+    int const fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw LSST_EXCEPT(pex::exceptions::IoError,
+                          (boost::format("Unable to open Kron aperture store %s") % fileName).str());
     }
-    try {
-        base::ApertureFluxResult fluxResult = base::ApertureFluxAlgorithm::computeSincFlux<float>(image, aperture);
-        return std::make_pair(fluxResult.flux, fluxResult.fluxSigma);
-    } catch(pex::exceptions::LengthError &e) {
-        LSST_EXCEPT_ADD(e, (boost::format("Measuring Kron flux for object at (%.3f, %.3f);"
-                                          " aperture radius %g,%g theta %g")
-                            % aperture.getCenter().getX() % aperture.getCenter().getY()
-                            % axes.getA() % axes.getB() % afw::geom::radToDeg(axes.getTheta())).str());
-        throw e;
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(KronApertureStoreHeader))) {
+        _mapSize = st.st_size;
+        _map = ::mmap(NULL, _mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);                        // the mapping survives closing the file
+    if (!_map || _map == MAP_FAILED) {
+        _map = NULL;
+        throw LSST_EXCEPT(pex::exceptions::IoError,
+                          (boost::format("Unable to map Kron aperture store %s") % fileName).str());
+    }
+
+    KronApertureStoreHeader const& header = *static_cast<KronApertureStoreHeader const*>(_map);
+    if (std::memcmp(header.magic, APERTURE_STORE_MAGIC, sizeof(APERTURE_STORE_MAGIC)) != 0 ||
+        header.nEntry < 0 ||
+        // check that there's room for nEntry entries before multiplying, as a corrupt nEntry may overflow
+        static_cast<boost::uint64_t>(header.nEntry) >
+            (_mapSize - sizeof(KronApertureStoreHeader))/sizeof(KronApertureEntry) ||
+        _mapSize != sizeof(KronApertureStoreHeader) + header.nEntry*sizeof(KronApertureEntry)) {
+        ::munmap(_map, _mapSize);
+        _map = NULL;
+        throw LSST_EXCEPT(pex::exceptions::IoError,
+                          (boost::format("%s is not a valid Kron aperture store") % fileName).str());
     }
+    _begin = reinterpret_cast<KronApertureEntry const*>(&header + 1);
+    _end = _begin + header.nEntry;
 }
 
+KronApertureStore::~KronApertureStore() {
+    if (_map) {
+        ::munmap(_map, _mapSize);
+    }
+}
 
-double calculatePsfKronRadius(
-    CONST_PTR(afw::detection::Psf) const& psf, // PSF to measure
-    afw::geom::Point2D const& center, // Centroid of source on parent image
-    double smoothingSigma=0.0         // Gaussian sigma of smoothing applied
-    )
-{
-    assert(psf);
-    double const radius = psf->computeShape(center).getDeterminantRadius();
-    // For a Gaussian N(0, sigma^2), the Kron radius is sqrt(pi/2)*sigma
-    return ::sqrt(afw::geom::PI/2)*::hypot(radius, std::max(0.0, smoothingSigma));
+KronApertureEntry const* KronApertureStore::find(afw::table::RecordId const id) const {
+    KronApertureEntry key;
+    key.id = id;
+    KronApertureEntry const* const ptr = std::lower_bound(_begin, _end, key, compareEntryIds);
+    return (ptr != _end && ptr->id == id) ? ptr : NULL;
 }
 
-template<typename ImageT>
-std::pair<double, double> KronAperture::measure(ImageT const& image, // Image of interest
-                                                double const nRadiusForFlux, // Kron radius multiplier
-                                                double const maxSincRadius // largest radius that we use sinc
-                                                                           // apertures to measure
-                                               ) const
-{
-    afw::geom::ellipses::Axes axes(getAxes()); // Copy of ellipse core, so we can scale
-    axes.scale(nRadiusForFlux);
-    afw::geom::ellipses::Ellipse const ellip(axes, getCenter());
+void KronApertureStore::write(std::string const& fileName, std::vector<KronApertureEntry> entries) {
+    std::sort(entries.begin(), entries.end(), compareEntryIds);
 
-    return photometer(image, ellip, maxSincRadius);
+    KronApertureStoreHeader header;
+    std::memcpy(header.magic, APERTURE_STORE_MAGIC, sizeof(APERTURE_STORE_MAGIC));
+    header.nEntry = entries.size();
+
+    std::ofstream out(fileName.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    if (!entries.empty()) {
+        out.write(reinterpret_cast<char const*>(&entries[0]), entries.size()*sizeof(KronApertureEntry));
+    }
+    out.close();
+    if (!out) {
+        throw LSST_EXCEPT(pex::exceptions::IoError,
+                          (boost::format("Unable to write Kron aperture store %s") % fileName).str());
+    }
 }
-/************************************************************************************************************/
 
+/************************************************************************************************************/
 /**
  * @brief A class that knows how to calculate fluxes using the KRON photometry algorithm
  *
@@ -414,10 +2243,30 @@ KronFluxAlgorithm::KronFluxAlgorithm(KronFluxControl const & ctrl, std::string c
         meas::base::FluxResultKey::addFields(schema, name, "flux from Kron Flux algorithm")
     ),
     _radiusKey(schema.addField<float>(name + "_radius", "Kron radius (sqrt(a*b))")),
+    _radiusErrKey(schema.addField<float>(name + "_radius_err",
+                                         "Error in the Kron radius (NaN if the image was smoothed, or the "
+                                         "radius was fixed, a fallback, or a minimum)")),
     _radiusForRadiusKey(schema.addField<float>(name + "_radius_for_radius",
                             "radius used to estimate <radius> (sqrt(a*b))")),
     _psfRadiusKey(schema.addField<float>(name + "_psf_radius", "Radius of PSF")),
-    _centroidExtractor(schema, name, true)
+    _nIterKey(schema.addField<int>(name + "_n_iter", "number of iterations used to estimate the Kron radius")),
+    _maskedFractionKey(schema.addField<float>(name + "_masked_fraction",
+                                              "fraction of the Kron aperture's pixels with any of "
+                                              "badMaskPlanes set (NaN if badMaskPlanes is empty)")),
+    _centroidExtractor(schema, name, true),
+    _psfRadiusCache(ctrl.psfRadiusGridSpacing > 0 ?
+                    boost::make_shared<PsfKronRadiusCache>(ctrl.psfRadiusGridSpacing, ctrl.smoothingSigma) :
+                    PTR(PsfKronRadiusCache)()),
+    _wcsPairCache(boost::make_shared<WcsPairCache>()),
+    _refRadiusKeyCache(boost::make_shared<ReferenceKeyCache>(name + "_radius")),
+    _sincCache(ctrl.sincCacheTolerance > 0 ?
+               boost::make_shared<SincCoeffsCache>(ctrl.sincCacheTolerance,
+                                                   1024.0*1024.0*ctrl.sincCacheMaxMemory) :
+               PTR(SincCoeffsCache)()),
+    _statsCollector(ctrl.collectStats ? boost::make_shared<KronFluxStatsCollector>() :
+                    PTR(KronFluxStatsCollector)()),
+    _badBits(getBadMaskBits(ctrl.badMaskPlanes)),
+    _mainIndex(0)
 {
     static boost::array<meas::base::FlagDefinition,N_FLAGS> const flagDefs = {{
         {"flag", "general failure flag, set if anything went wrong"},
@@ -430,8 +2279,86 @@ KronFluxAlgorithm::KronFluxAlgorithm(KronFluxControl const & ctrl, std::string c
         {"flag_used_psf_radius", "used the PSF Kron radius for the Kron aperture"},
         {"flag_small_radius", "measured Kron radius was smaller than that of the PSF"},
         {"flag_bad_shape", "shape for measuring Kron radius is bad; used PSF shape"},
+        {"flag_masked", "the Kron aperture contained pixels with badMaskPlanes set"},
     }};
     _flagHandler = meas::base::FlagHandler::addFields(schema, name, flagDefs.begin(), flagDefs.end());
+    //
+    // Fields for the fluxes in the extra apertures, which are all measured along with the main one
+    //
+    if (!ctrl.extraNRadiusForFlux.empty()) {
+        // Check that each extra aperture gets its own fields before adding any of them to the schema
+        std::map<std::string, double> apNames; // the names we've chosen, and the radii they're for
+        for (std::size_t i = 0; i != ctrl.extraNRadiusForFlux.size(); ++i) {
+            double const nRadius = ctrl.extraNRadiusForFlux[i];
+            if (!(nRadius > 0)) {
+                throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,
+                                  (boost::format("extraNRadiusForFlux must be > 0; saw %g") % nRadius).str());
+            }
+            if (nRadius == ctrl.nRadiusForFlux) {
+                throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,
+                                  (boost::format("extraNRadiusForFlux contains nRadiusForFlux (%g), which is "
+                                                 "always measured") % nRadius).str());
+            }
+            std::string const apName = getApertureName(name, nRadius);
+            std::map<std::string, double>::const_iterator const ptr = apNames.find(apName);
+            if (ptr != apNames.end()) {
+                throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,
+                                  (boost::format("extraNRadiusForFlux values %g and %g would both be "
+                                                 "measured in fields %s_*") % ptr->second % nRadius
+                                   % apName).str());
+            }
+            apNames[apName] = nRadius;
+        }
+
+        _nRadiusForFlux = ctrl.extraNRadiusForFlux;
+        _nRadiusForFlux.push_back(ctrl.nRadiusForFlux);
+        std::sort(_nRadiusForFlux.begin(), _nRadiusForFlux.end());
+        _nRadiusForFlux.erase(std::unique(_nRadiusForFlux.begin(), _nRadiusForFlux.end()),
+                              _nRadiusForFlux.end());
+        _mainIndex = std::lower_bound(_nRadiusForFlux.begin(), _nRadiusForFlux.end(), ctrl.nRadiusForFlux) -
+            _nRadiusForFlux.begin();
+
+        for (std::size_t i = 0; i != ctrl.extraNRadiusForFlux.size(); ++i) {
+            double const nRadius = ctrl.extraNRadiusForFlux[i];
+            std::string const apName = getApertureName(name, nRadius);
+            _extraIndex.push_back(std::lower_bound(_nRadiusForFlux.begin(), _nRadiusForFlux.end(), nRadius) -
+                                  _nRadiusForFlux.begin());
+            _extraFluxResultKeys.push_back(meas::base::FluxResultKey::addFields(
+                schema, apName, (boost::format("flux within %g Kron radii") % nRadius).str()));
+            _extraFlagKeys.push_back(schema.addField<afw::table::Flag>(
+                apName + "_flag", (boost::format("flux within %g Kron radii couldn't be measured")
+                                   % nRadius).str()));
+        }
+    }
+}
+
+SincCacheStats KronFluxAlgorithm::getSincCacheStats() const {
+    return _sincCache ? _sincCache->getStats() : SincCacheStats();
+}
+
+KronFluxStats KronFluxAlgorithm::getStats() const {
+    return _statsCollector ? _statsCollector->get() : KronFluxStats();
+}
+
+void KronFluxAlgorithm::resetStats() {
+    if (_statsCollector) {
+        _statsCollector->reset();
+    }
+}
+
+double KronFluxAlgorithm::_getPsfKronRadius(
+    CONST_PTR(afw::detection::Psf) const& psf,
+    afw::geom::Box2I const& bbox,
+    afw::geom::Point2D const& center
+    ) const
+{
+    if (!psf) {
+        return -1;
+    }
+    if (_psfRadiusCache) {
+        return (*_psfRadiusCache)(psf, bbox, center);
+    }
+    return calculatePsfKronRadius(psf, center, _ctrl.smoothingSigma);
 }
 
 void KronFluxAlgorithm::fail(
@@ -439,12 +2366,26 @@ void KronFluxAlgorithm::fail(
     meas::base::MeasurementError * error
 ) const {
     _flagHandler.handleFailure(measRecord, error);
+    for (std::size_t i = 0; i != _extraFlagKeys.size(); ++i) {
+        measRecord.set(_extraFlagKeys[i], true);
+    }
+}
+
+void KronFluxAlgorithm::_failEdge(afw::table::SourceRecord & source, KronFluxStats *stats) const
+{
+    if (stats) {
+        ++stats->nEdge;
+    }
+    fail(source);
+    _flagHandler.setValue(source, EDGE, true);
 }
 
-void KronFluxAlgorithm::_applyAperture(
+template<typename PixelT>
+bool KronFluxAlgorithm::_applyAperture(
     afw::table::SourceRecord & source,
-    afw::image::Exposure<float> const& exposure,
-    KronAperture const& aperture
+    afw::image::Exposure<PixelT> const& exposure,
+    KronAperture const& aperture,
+    KronFluxStats *stats
     ) const
 {
     double const rad = aperture.getAxes().getDeterminantRadius();
@@ -457,15 +2398,49 @@ void KronFluxAlgorithm::_applyAperture(
     }
 
     std::pair<double, double> result;
-    try {
-        result = aperture.measure(exposure.getMaskedImage(), _ctrl.nRadiusForFlux, _ctrl.maxSincRadius);
-    } catch (pex::exceptions::LengthError const& e) {
-        // We hit the edge of the image; there's no reasonable fallback or recovery
-        throw LSST_EXCEPT(
-            meas::base::MeasurementError,
-            _flagHandler.getDefinition(EDGE).doc,
-            EDGE
-        );
+    double maskedFraction = 0.0;        // fraction of the main aperture's pixels with _badBits set
+    if (_nRadiusForFlux.empty()) {
+        afw::geom::ellipses::Axes axes(aperture.getAxes());
+        axes.scale(_ctrl.nRadiusForFlux);
+        bool ok = (axes.getB() > _ctrl.maxSincRadius ||
+                   sincApertureMayFit(exposure.getBBox(), axes, aperture.getCenter()));
+        if (ok) {
+            try {
+                result = aperture.measure(exposure.getMaskedImage(), _ctrl.nRadiusForFlux,
+                                          _ctrl.maxSincRadius, _sincCache.get(), stats, _badBits,
+                                          &maskedFraction);
+            } catch (pex::exceptions::LengthError const&) {
+                ok = false;             // the sinc coefficients extended beyond the image
+            }
+        }
+        if (!ok) {
+            // We hit the edge of the image; there's no reasonable fallback or recovery
+            _failEdge(source, stats);
+            return false;
+        }
+    } else {
+        std::vector<KronAperture::Flux> fluxes;
+        aperture.measure(exposure.getMaskedImage(), _nRadiusForFlux, _ctrl.maxSincRadius, &fluxes,
+                         _sincCache.get(), stats, _badBits);
+        bool const ok = fluxes[_mainIndex].ok;
+        if (!ok) {
+            // We hit the edge of the image; there's no reasonable fallback or recovery.
+            // Fail before setting the extra apertures, as fail() sets all their flags
+            _failEdge(source, stats);
+        }
+        for (std::size_t i = 0; i != _extraIndex.size(); ++i) {
+            KronAperture::Flux const& flux = fluxes[_extraIndex[i]];
+            meas::base::FluxResult fluxResult;
+            fluxResult.flux = flux.flux;
+            fluxResult.fluxSigma = flux.fluxSigma;
+            source.set(_extraFluxResultKeys[i], fluxResult);
+            source.set(_extraFlagKeys[i], !flux.ok);
+        }
+        if (!ok) {
+            return false;
+        }
+        result = std::make_pair(fluxes[_mainIndex].flux, fluxes[_mainIndex].fluxSigma);
+        maskedFraction = fluxes[_mainIndex].maskedFraction;
     }
     // set the results in the source object
     meas::base::FluxResult fluxResult;
@@ -473,9 +2448,16 @@ void KronFluxAlgorithm::_applyAperture(
     fluxResult.fluxSigma = result.second;
     source.set(_fluxResultKey, fluxResult);
     source.set(_radiusKey, aperture.getAxes().getDeterminantRadius());
+    if (_badBits) {
+        source.set(_maskedFractionKey, maskedFraction);
+        if (maskedFraction > 0) {
+            _flagHandler.setValue(source, MASKED, true);
+        }
+    }
     //
     //  REMINDER:  In the old code, the psfFactor is calculated using getPsfFactor,
     //  and the values set for _fluxCorrectionKeys.  See old meas_algorithms version.
+    return true;
 }
 
 void KronFluxAlgorithm::_applyForced(
@@ -483,32 +2465,350 @@ void KronFluxAlgorithm::_applyForced(
         afw::image::Exposure<float> const & exposure,
         afw::geom::Point2D const & center,
         afw::table::SourceRecord const & reference,
+        afw::table::Key<float> const & refRadiusKey,
         afw::geom::AffineTransform const & refToMeas
     ) const
 {
-    float const radius = reference.get(reference.getSchema().find<float>(_name + "_radius").key);
-    KronAperture const aperture(reference, refToMeas, radius);
-    _applyAperture(source, exposure, aperture);
+    float const radius = reference.get(refRadiusKey);
+    _applyForced(source, exposure, center, KronAperture(reference, refToMeas, radius));
+}
+
+bool KronFluxAlgorithm::_applyForced(
+        afw::table::SourceRecord & source,
+        afw::image::Exposure<float> const & exposure,
+        afw::geom::Point2D const & center,
+        KronAperture const & aperture
+    ) const
+{
+    LocalStats stats(_statsCollector.get());
+    if (stats.get()) {
+        ++stats.get()->nSource;
+    }
+    if (!_applyAperture(source, exposure, aperture, stats.get())) {
+        return false;
+    }
     if (exposure.getPsf()) {
-        source.set(_psfRadiusKey, calculatePsfKronRadius(exposure.getPsf(), center, _ctrl.smoothingSigma));
+        StageTimer timer(stats.get() ? &stats.get()->psfTime : NULL);
+        source.set(_psfRadiusKey, _getPsfKronRadius(exposure.getPsf(), exposure.getBBox(), center));
     }
+    return true;
 }
 
 void KronFluxAlgorithm::measure(
                       afw::table::SourceRecord & source,
                       afw::image::Exposure<float> const& exposure
                      ) const {
-    afw::geom::Point2D center = _centroidExtractor(source, _flagHandler);
+    ExposureContext<float> const context(exposure, _ctrl);
+    Workspace<float> workspace(context, _statsCollector.get());
+    afw::geom::Point2D const center = _centroidExtractor(source, _flagHandler);
+    double R_K_psf;
+    {
+        KronFluxStats *stats = workspace.stats.get();
+        StageTimer timer(stats ? &stats->psfTime : NULL);
+        R_K_psf = _getPsfKronRadius(context.psf, exposure.getBBox(), center);
+    }
+    _measure(source, context, workspace, center, R_K_psf);
+}
+
+void KronFluxAlgorithm::measureCatalog(
+                      afw::table::SourceCatalog & catalog,
+                      afw::image::Exposure<float> const& exposure
+                     ) const {
+    _measureCatalog(catalog, exposure);
+}
+
+void KronFluxAlgorithm::measureCatalog(
+                      afw::table::SourceCatalog & catalog,
+                      afw::image::Exposure<double> const& exposure
+                     ) const {
+    _measureCatalog(catalog, exposure);
+}
+
+template<typename PixelT>
+void KronFluxAlgorithm::_measureCatalog(
+                      afw::table::SourceCatalog & catalog,
+                      afw::image::Exposure<PixelT> const& exposure,
+                      afw::geom::Box2I const& fullBBox,
+                      DeferredSources *deferred
+                     ) const {
+    ExposureContext<PixelT> context(exposure, _ctrl, fullBBox, deferred);
+    if (_ctrl.cacheSmoothedImage && context.kernel) {
+        // Released when we return, along with the rest of the context
+        context.smoothedImageCache = boost::make_shared<SmoothedImageCache<PixelT> >(
+            *context.mimage.getImage(), context.kernel, _ctrl.smoothingTileSize, _ctrl.smoothingTileBudget);
+    }
+    //
+    // Evaluate everything that needs the PSF serially, as Psfs aren't thread safe
+    //
+    typename CatalogWorker<PixelT>::SourceBatch batch(catalog.size());
+    LocalStats setupStats(_statsCollector.get());
+    for (std::size_t i = 0; i != catalog.size(); ++i) {
+        afw::table::SourceRecord & source = catalog[i];
+        try {
+            afw::geom::Point2D const center = _centroidExtractor(source, _flagHandler);
+            batch.x[i] = center.getX();
+            batch.y[i] = center.getY();
+            StageTimer timer(setupStats.get() ? &setupStats.get()->psfTime : NULL);
+            batch.R_K_psf[i] = _getPsfKronRadius(context.psf, context.fullBBox, center);
+            if (context.psf && source.getShapeFlag()) {
+                context.getPsfShape();
+            }
+            batch.order.push_back(i);
+        } catch (meas::base::MeasurementError & error) {
+            fail(source, &error);
+        } catch (meas::base::FatalAlgorithmError &) {
+            throw;
+        } catch (pex::exceptions::Exception &) {
+            fail(source);
+        }
+    }
+    batch.sortByPosition(context.fullBBox);
+    //
+    // Now do the real work
+    //
+    int nThreads = _ctrl.nThreads > 0 ? _ctrl.nThreads : boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, static_cast<int>(catalog.size())));
+
+    CatalogWorker<PixelT> worker(*this, catalog, context, batch);
+    if (nThreads == 1) {
+        worker();
+    } else {
+        boost::thread_group threads;
+        for (int i = 0; i != nThreads; ++i) {
+            threads.create_thread(boost::ref(worker));
+        }
+        threads.join_all();
+    }
+    worker.rethrow();
+}
+
+void KronFluxAlgorithm::measureCatalogFromFile(
+                      afw::table::SourceCatalog & catalog,
+                      std::string const& fileName,
+                      int const tileSize,
+                      int const tileMargin
+                     ) const {
+    if (tileSize <= 0 || tileMargin < 0) {
+        throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,
+                          (boost::format("tileSize must be > 0 and tileMargin >= 0; saw %d, %d")
+                           % tileSize % tileMargin).str());
+    }
+    // The pixels are in the first extension of an Exposure's file
+    afw::geom::Box2I const fullBBox = afw::image::bboxFromMetadata(*afw::image::readMetadata(fileName, 1));
+    int const nx = (fullBBox.getWidth() + tileSize - 1)/tileSize;
+    int const ny = (fullBBox.getHeight() + tileSize - 1)/tileSize;
+    //
+    // Sort the sources into the tiles that contain their centres
+    //
+    std::vector<std::vector<std::size_t> > tiles(nx*ny);
+    for (std::size_t i = 0; i != catalog.size(); ++i) {
+        afw::table::SourceRecord & source = catalog[i];
+        afw::geom::Point2D center;
+        try {
+            center = _centroidExtractor(source, _flagHandler);
+        } catch (meas::base::MeasurementError & error) {
+            fail(source, &error);
+            continue;
+        } catch (meas::base::FatalAlgorithmError &) {
+            throw;
+        } catch (pex::exceptions::Exception &) {
+            fail(source);
+            continue;
+        }
+        double const x = (center.getX() - fullBBox.getMinX())/tileSize;
+        double const y = (center.getY() - fullBBox.getMinY())/tileSize;
+        int const ix = (x > 0) ? std::min(static_cast<int>(x), nx - 1) : 0; // also handles NaN
+        int const iy = (y > 0) ? std::min(static_cast<int>(y), ny - 1) : 0;
+        tiles[iy*nx + ix].push_back(i);
+    }
+    //
+    // Measure each tile's sources, deferring those that need pixels from beyond the tile's margin
+    //
+    DeferredSources deferred;
+    for (int iy = 0; iy != ny; ++iy) {
+        for (int ix = 0; ix != nx; ++ix) {
+            std::vector<std::size_t> const& indices = tiles[iy*nx + ix];
+            if (indices.empty()) {
+                continue;
+            }
+            afw::geom::Box2I region(fullBBox.getMin() + afw::geom::Extent2I(ix*tileSize, iy*tileSize),
+                                    afw::geom::Extent2I(tileSize, tileSize));
+            region.grow(tileMargin);
+            region.clip(fullBBox);
+
+            afw::image::Exposure<float> const exposure(fileName, region, afw::image::PARENT);
+            afw::table::SourceCatalog tileCatalog(catalog.getTable()); // shares catalog's records
+            tileCatalog.reserve(indices.size());
+            for (std::size_t i = 0; i != indices.size(); ++i) {
+                tileCatalog.push_back(catalog.get(indices[i]));
+            }
+            _measureCatalog(tileCatalog, exposure, fullBBox, &deferred);
+        }
+    }
+    //
+    // Measure each deferred source on the pixels that it needs, growing the region until it has them all
+    // (or it needs pixels that don't exist)
+    //
+    DeferredSources::Map const& pending = deferred.get();
+    for (std::size_t i = 0; i != catalog.size() && !pending.empty(); ++i) {
+        DeferredSources::Map::const_iterator const ptr = pending.find(&catalog[i]);
+        if (ptr == pending.end()) {
+            continue;
+        }
+        afw::table::SourceCatalog sourceCatalog(catalog.getTable());
+        sourceCatalog.push_back(catalog.get(i));
+
+        afw::geom::Box2I region = ptr->second;
+        region.clip(fullBBox);
+        for (;;) {
+            _resetRecord(catalog[i]);
+            afw::image::Exposure<float> const exposure(fileName, region, afw::image::PARENT);
+            DeferredSources again;
+            _measureCatalog(sourceCatalog, exposure, fullBBox, &again);
+            if (again.get().empty()) {
+                break;
+            }
+            afw::geom::Box2I grown = region;
+            grown.include(again.get().begin()->second);
+            grown.clip(fullBBox);
+            if (grown == region) {
+                // We have all the pixels that it could need, so it failed because of the image's edges
+                _resetRecord(catalog[i]);
+                _measureCatalog(sourceCatalog, exposure, fullBBox);
+                break;
+            }
+            region = grown;
+        }
+    }
+}
+
+void KronFluxAlgorithm::measureChildren(
+                      afw::table::SourceCatalog & catalog,
+                      afw::image::Exposure<float> const& exposure,
+                      int const noiseSeed
+                     ) const {
+    typedef afw::detection::HeavyFootprint<float> HeavyFootprint;
+    afw::geom::Box2I const& fullBBox = exposure.getBBox();
+    //
+    // The sources that aren't children are measured on the exposure as usual
+    //
+    afw::table::SourceCatalog others(catalog.getTable()); // shares catalog's records
+    std::vector<std::size_t> children;
+    for (std::size_t i = 0; i != catalog.size(); ++i) {
+        CONST_PTR(afw::detection::Footprint) const& foot = catalog[i].getFootprint();
+        if (foot && foot->isHeavy()) {
+            children.push_back(i);
+        } else {
+            others.push_back(catalog.get(i));
+        }
+    }
+    if (!others.empty()) {
+        _measureCatalog(others, exposure);
+    }
+    //
+    // Measure each child on its own pixels over noise, starting with its Footprint's bounding box and
+    // growing the region until it has all the pixels that the child needs (or it needs pixels that don't
+    // exist)
+    //
+    for (std::size_t i = 0; i != children.size(); ++i) {
+        afw::table::SourceRecord & source = catalog[children[i]];
+        CONST_PTR(HeavyFootprint) const heavy =
+            boost::dynamic_pointer_cast<HeavyFootprint const>(source.getFootprint());
+        if (!heavy) {                   // a HeavyFootprint, but not of floats
+            fail(source);
+            continue;
+        }
+        afw::table::SourceCatalog sourceCatalog(catalog.getTable());
+        sourceCatalog.push_back(catalog.get(children[i]));
+
+        afw::geom::Box2I region = heavy->getBBox();
+        region.clip(fullBBox);
+        for (;;) {
+            // Use the same noise for every try (+1 as the generator refuses a seed of 0)
+            afw::math::Random rand(afw::math::Random::MT19937, noiseSeed + source.getId() + 1);
+            afw::image::Exposure<float> const child = makeChildExposure(exposure, *heavy, region, rand);
+            _resetRecord(source);
+            DeferredSources again;
+            _measureCatalog(sourceCatalog, child, fullBBox, &again);
+            if (again.get().empty()) {
+                break;
+            }
+            afw::geom::Box2I grown = region;
+            grown.include(again.get().begin()->second);
+            grown.clip(fullBBox);
+            if (grown == region) {
+                // We have all the pixels that it could need, so it failed because of the image's edges
+                _resetRecord(source);
+                _measureCatalog(sourceCatalog, child, fullBBox);
+                break;
+            }
+            region = grown;
+        }
+    }
+}
+
+void KronFluxAlgorithm::_resetRecord(afw::table::SourceRecord & source) const {
+    float const NaN = std::numeric_limits<float>::quiet_NaN();
+    source.set(_fluxResultKey, meas::base::FluxResult());
+    source.set(_radiusKey, NaN);
+    source.set(_radiusErrKey, NaN);
+    source.set(_radiusForRadiusKey, NaN);
+    source.set(_psfRadiusKey, NaN);
+    source.set(_nIterKey, 0);
+    source.set(_maskedFractionKey, NaN);
+    for (int i = 0; i != N_FLAGS; ++i) {
+        _flagHandler.setValue(source, i, false);
+    }
+    for (std::size_t i = 0; i != _extraFluxResultKeys.size(); ++i) {
+        source.set(_extraFluxResultKeys[i], meas::base::FluxResult());
+        source.set(_extraFlagKeys[i], false);
+    }
+}
+
+template<typename PixelT>
+void KronFluxAlgorithm::_measureOrFail(
+                      afw::table::SourceRecord & source,
+                      ExposureContext<PixelT> const& context,
+                      Workspace<PixelT> & workspace,
+                      afw::geom::Point2D const& center,
+                      double const R_K_psf
+                     ) const {
+    // If we defer the source we forget the statistics of this attempt, as they'll be gathered again
+    KronFluxStats *stats = workspace.stats.get();
+    KronFluxStats const before = stats ? *stats : KronFluxStats();
+    // Handle failures the same way as the measurement framework does
+    try {
+        _measure(source, context, workspace, center, R_K_psf);
+    } catch (RegionTooSmallError & error) {
+        if (stats) {
+            *stats = before;
+        }
+        context.deferred->add(source, error.getBBox()); // we'll try again with more pixels
+    } catch (meas::base::MeasurementError & error) {
+        fail(source, &error);
+    } catch (meas::base::FatalAlgorithmError &) {
+        throw;
+    } catch (pex::exceptions::Exception &) {
+        fail(source);
+    }
+}
 
+template<typename PixelT>
+void KronFluxAlgorithm::_measure(
+                      afw::table::SourceRecord & source,
+                      ExposureContext<PixelT> const& context,
+                      Workspace<PixelT> & workspace,
+                      afw::geom::Point2D const& center,
+                      double const R_K_psf
+                     ) const {
     // Did we hit a condition that fundamentally prevented measuring the Kron flux?
     // Such conditions include hitting the edge of the image and bad input shape, but not low signal-to-noise.
     bool bad = false;
 
-    afw::image::MaskedImage<float> const& mimage = exposure.getMaskedImage();
-
-    double R_K_psf = -1;
-    if (exposure.getPsf()) {
-        R_K_psf = calculatePsfKronRadius(exposure.getPsf(), center, _ctrl.smoothingSigma);
+    afw::image::Exposure<PixelT> const& exposure = context.exposure;
+    KronFluxStats *stats = workspace.stats.get();
+    if (stats) {
+        ++stats->nSource;
     }
 
     //
@@ -519,14 +2819,14 @@ void KronFluxAlgorithm::measure(
         axes = source.getShape();
     } else {
         bad = true;
-        if (!exposure.getPsf()) {
+        if (!context.psf) {
             throw LSST_EXCEPT(
                 meas::base::MeasurementError,
                 _flagHandler.getDefinition(NO_SHAPE_NO_PSF).doc,
                 NO_SHAPE_NO_PSF
             );
         }
-        axes = exposure.getPsf()->computeShape();
+        axes = context.getPsfShape();
         _flagHandler.setValue(source, BAD_SHAPE, true);
     }
     if (_ctrl.useFootprintRadius) {
@@ -544,27 +2844,45 @@ void KronFluxAlgorithm::measure(
         }
     }
 
-    PTR(KronAperture) aperture;
+    KronAperture aperture(center, axes);
     float radiusForRadius = std::numeric_limits<double>::quiet_NaN();
+    float radiusErr = std::numeric_limits<float>::quiet_NaN();
+    int nIter = 0;
     if (_ctrl.fixed) {
-        aperture.reset(new KronAperture(source));
+        aperture = KronAperture(source);
     } else {
+        // estimate() checks that the first aperture fits in the image before doing any work; as this is
+        // the commonest way to hit the edge it tells us so without throwing
+        bool hitEdge = false;
         try {
-            aperture = KronAperture::determine(mimage, axes, center, _ctrl, &radiusForRadius);
-        } catch (pex::exceptions::OutOfRangeError& e) {
-            // We hit the edge of the image: no reasonable fallback or recovery possible
-            throw LSST_EXCEPT(
-                meas::base::MeasurementError,
-                _flagHandler.getDefinition(EDGE).doc,
-                EDGE
-            );
+            aperture = KronAperture::estimate(context.mimage, axes, center, _ctrl, _badBits,
+                                              &radiusForRadius, workspace.smoother.get(), &nIter,
+                                              &radiusErr, stats, &hitEdge);
+        } catch (pex::exceptions::OutOfRangeError&) {
+            hitEdge = true;
         } catch (BadKronException& e) {
             // Not setting bad=true because we only failed due to low S/N
+            if (stats) {
+                ++stats->nFallback;
+            }
+            radiusErr = std::numeric_limits<float>::quiet_NaN();
             aperture = _fallbackRadius(source, R_K_psf, e);
         } catch(pex::exceptions::Exception& e) {
             bad = true; // There's something fundamental keeping us from measuring the Kron aperture
+            if (stats) {
+                ++stats->nFallback;
+            }
+            radiusErr = std::numeric_limits<float>::quiet_NaN();
             aperture = _fallbackRadius(source, R_K_psf, e);
         }
+        if (hitEdge) {
+            // If we're only measuring part of the image we may just need more pixels
+            context.checkRegion(getRegionNeeded(center, axes, radiusForRadius, context.kernel, aperture,
+                                                std::vector<double>(), _ctrl.maxSincRadius));
+            // We hit the edge of the image: no reasonable fallback or recovery possible
+            _failEdge(source, stats);
+            return;
+        }
     }
 
     /*
@@ -573,7 +2891,7 @@ void KronFluxAlgorithm::measure(
      */
 
     // Enforce constraints on minimum radius
-    double rad = aperture->getAxes().getDeterminantRadius();
+    double rad = aperture.getAxes().getDeterminantRadius();
     if (_ctrl.enforceMinimumRadius) {
         double newRadius = rad;
         if (_ctrl.minimumRadius > 0.0) {
@@ -581,7 +2899,7 @@ void KronFluxAlgorithm::measure(
                 newRadius = _ctrl.minimumRadius;
                 _flagHandler.setValue(source, USED_MINIMUM_RADIUS, true);
             }
-        } else if (!exposure.getPsf()) {
+        } else if (!context.psf) {
             throw LSST_EXCEPT(
                 meas::base::MeasurementError,
                 _flagHandler.getDefinition(NO_MINIMUM_RADIUS).doc,
@@ -592,13 +2910,33 @@ void KronFluxAlgorithm::measure(
             _flagHandler.setValue(source, USED_PSF_RADIUS, true);
         }
         if (newRadius != rad) {
-            aperture->getAxes().scale(newRadius/rad);
+            radiusErr = std::numeric_limits<float>::quiet_NaN();
+            aperture.getAxes().scale(newRadius/rad);
             _flagHandler.setValue(source, SMALL_RADIUS, true); // guilty after all
         }
     }
 
-    _applyAperture(source, exposure, *aperture);
+    if (!context.deferred) {
+        if (!_applyAperture(source, exposure, aperture, stats)) {
+            return;
+        }
+    } else {
+        // We're only measuring part of the image; check that we have all the pixels that we need
+        std::vector<double> const nRadiusForFlux = _nRadiusForFlux.empty() ?
+            std::vector<double>(1, _ctrl.nRadiusForFlux) : _nRadiusForFlux;
+        afw::geom::Box2I needed = getRegionNeeded(center, axes, radiusForRadius, context.kernel, aperture,
+                                                  nRadiusForFlux, _ctrl.maxSincRadius);
+        context.checkRegion(needed);
+        if (!_applyAperture(source, exposure, aperture, stats)) {
+            // We may have underestimated the extent of the sinc coefficients; ask for more
+            needed.grow(std::max(needed.getWidth(), needed.getHeight())/2 + SINC_BORDER);
+            context.checkRegion(needed);
+            return;
+        }
+    }
+    source.set(_radiusErrKey, radiusErr);
     source.set(_radiusForRadiusKey, radiusForRadius);
+    source.set(_nIterKey, nIter);
     source.set(_psfRadiusKey, R_K_psf);
     if (bad) _flagHandler.setValue(source, FAILURE, true);
 }
@@ -610,17 +2948,252 @@ void KronFluxAlgorithm::measureForced(
         afw::image::Wcs const & refWcs
     ) const {
     afw::geom::Point2D center = _centroidExtractor(measRecord, _flagHandler);
-    CONST_PTR(afw::image::Wcs) refWcsPtr(refWcs.clone());
-    afw::image::XYTransformFromWcsPair xytransform(exposure.getWcs(), refWcsPtr);
-    _applyForced(measRecord, exposure, center, refRecord,
-                    xytransform.linearizeForwardTransform(refRecord.getCentroid())
-                );
+    _applyForced(measRecord, exposure, center, refRecord, (*_refRadiusKeyCache)(refRecord),
+                 (*_wcsPairCache)(exposure.getWcs(), refWcs, refRecord.getCentroid()));
+}
+
+void KronFluxAlgorithm::measureForcedCatalog(
+        afw::table::SourceCatalog & measCatalog,
+        afw::image::Exposure<float> const & exposure,
+        afw::table::SourceCatalog const & refCatalog,
+        afw::image::Wcs const & refWcs
+    ) const {
+    if (measCatalog.size() != refCatalog.size()) {
+        throw LSST_EXCEPT(pex::exceptions::LengthError,
+                          (boost::format("Measurement and reference catalogs have different lengths: %d v. %d")
+                           % measCatalog.size() % refCatalog.size()).str());
+    }
+    if (measCatalog.empty()) {
+        return;
+    }
+    afw::table::Key<float> const refRadiusKey = refCatalog.getSchema().find<float>(_name + "_radius").key;
+
+    for (std::size_t i = 0; i != measCatalog.size(); ++i) {
+        afw::table::SourceRecord & source = measCatalog[i];
+        afw::table::SourceRecord const & reference = refCatalog[i];
+        // Handle failures the same way as the measurement framework does
+        try {
+            afw::geom::Point2D const center = _centroidExtractor(source, _flagHandler);
+            _applyForced(source, exposure, center, reference, refRadiusKey,
+                         (*_wcsPairCache)(exposure.getWcs(), refWcs, reference.getCentroid()));
+        } catch (meas::base::MeasurementError & error) {
+            fail(source, &error);
+        } catch (meas::base::FatalAlgorithmError &) {
+            throw;
+        } catch (pex::exceptions::Exception &) {
+            fail(source);
+        }
+    }
+
+}
+
+void KronFluxAlgorithm::measureBands(
+        std::vector<afw::table::SourceCatalog> & bandCatalogs,
+        std::vector<CONST_PTR(afw::image::Exposure<float>)> const & exposures,
+        afw::table::SourceCatalog const & refCatalog,
+        afw::image::Wcs const & refWcs
+    ) const {
+    if (bandCatalogs.size() != exposures.size()) {
+        throw LSST_EXCEPT(pex::exceptions::LengthError,
+                          (boost::format("Numbers of catalogs and exposures differ: %d v. %d")
+                           % bandCatalogs.size() % exposures.size()).str());
+    }
+    for (std::size_t j = 0; j != bandCatalogs.size(); ++j) {
+        if (bandCatalogs[j].size() != refCatalog.size()) {
+            throw LSST_EXCEPT(pex::exceptions::LengthError,
+                              (boost::format("Catalog for band %d and reference catalog have different "
+                                             "lengths: %d v. %d")
+                               % j % bandCatalogs[j].size() % refCatalog.size()).str());
+        }
+        if (!exposures[j]) {
+            throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,
+                              (boost::format("Exposure for band %d is null") % j).str());
+        }
+    }
+    if (refCatalog.empty()) {
+        return;
+    }
+    afw::table::Key<float> const refRadiusKey = refCatalog.getSchema().find<float>(_name + "_radius").key;
+    afw::geom::AffineTransform const identity;
+    //
+    // The reference apertures are the same for all the bands, so only build them once
+    //
+    std::vector<KronAperture> refApertures;
+    refApertures.reserve(refCatalog.size());
+    for (std::size_t i = 0; i != refCatalog.size(); ++i) {
+        refApertures.push_back(KronAperture(refCatalog[i], identity, refCatalog[i].get(refRadiusKey)));
+    }
+    //
+    // Measure one band at a time, so that its pixels stay in cache
+    //
+    for (std::size_t j = 0; j != bandCatalogs.size(); ++j) {
+        afw::table::SourceCatalog & catalog = bandCatalogs[j];
+        afw::image::Exposure<float> const & exposure = *exposures[j];
+        // If the band is pixel-aligned with the reference we don't need to transform the apertures
+        bool const aligned = exposure.getWcs() && *exposure.getWcs() == refWcs;
+
+        for (std::size_t i = 0; i != catalog.size(); ++i) {
+            afw::table::SourceRecord & source = catalog[i];
+            KronAperture const & refAperture = refApertures[i];
+            // Handle failures the same way as the measurement framework does
+            try {
+                afw::geom::Point2D const center = _centroidExtractor(source, _flagHandler);
+                _applyForced(source, exposure, center,
+                             aligned ? refAperture :
+                             refAperture.transformed((*_wcsPairCache)(exposure.getWcs(), refWcs,
+                                                                      refCatalog[i].getCentroid())));
+            } catch (meas::base::MeasurementError & error) {
+                fail(source, &error);
+            } catch (meas::base::FatalAlgorithmError &) {
+                throw;
+            } catch (pex::exceptions::Exception &) {
+                fail(source);
+            }
+        }
+    }
+}
+
+void KronFluxAlgorithm::writeApertures(
+        afw::table::SourceCatalog const & catalog,
+        std::string const & fileName
+    ) const {
+    std::vector<KronApertureEntry> entries;
+    entries.reserve(catalog.size());
+    afw::geom::AffineTransform const identity;
+    for (std::size_t i = 0; i != catalog.size(); ++i) {
+        afw::table::SourceRecord const & source = catalog[i];
+        float const radius = source.get(_radiusKey);
+        if (!(radius > 0)) {            // also catches NaN
+            continue;
+        }
+        // The same aperture that measureForced() would use with source as the reference
+        KronAperture const aperture(source, identity, radius);
+        afw::geom::ellipses::Axes const& axes = aperture.getAxes();
+        if (!utils::isfinite(aperture.getX()) || !utils::isfinite(aperture.getY()) ||
+            !utils::isfinite(axes.getA()) || !utils::isfinite(axes.getB())) {
+            continue;
+        }
+        KronApertureEntry entry;
+        entry.id = source.getId();
+        entry.x = aperture.getX();
+        entry.y = aperture.getY();
+        entry.a = axes.getA();
+        entry.b = axes.getB();
+        entry.theta = axes.getTheta();
+        entry.radiusForRadius = source.get(_radiusForRadiusKey);
+        entries.push_back(entry);
+    }
+    KronApertureStore::write(fileName, entries);
+}
+
+void KronFluxAlgorithm::measureForcedFromStore(
+        afw::table::SourceCatalog & measCatalog,
+        afw::image::Exposure<float> const & exposure,
+        KronApertureStore const & store,
+        afw::image::Wcs const & refWcs
+    ) const {
+    for (std::size_t i = 0; i != measCatalog.size(); ++i) {
+        afw::table::SourceRecord & source = measCatalog[i];
+        // Handle failures the same way as the measurement framework does
+        try {
+            afw::geom::Point2D const center = _centroidExtractor(source, _flagHandler);
+            KronApertureEntry const* entry = store.find(source.getId());
+            if (!entry) {
+                fail(source);           // there's no reference aperture
+                continue;
+            }
+            afw::geom::Point2D const refCenter(entry->x, entry->y);
+            afw::geom::AffineTransform const refToMeas =
+                (*_wcsPairCache)(exposure.getWcs(), refWcs, refCenter);
+            KronAperture const refAperture(refCenter, afw::geom::ellipses::Axes(entry->a, entry->b,
+                                                                                  entry->theta));
+            if (_applyForced(source, exposure, center, refAperture.transformed(refToMeas))) {
+                source.set(_radiusForRadiusKey, entry->radiusForRadius);
+            }
+        } catch (meas::base::MeasurementError & error) {
+            fail(source, &error);
+        } catch (meas::base::FatalAlgorithmError &) {
+            throw;
+        } catch (pex::exceptions::Exception &) {
+            fail(source);
+        }
+    }
+}
 
+void KronFluxAlgorithm::measureArrays(
+        KronFluxControl const & ctrl,
+        afw::image::Exposure<float> const & exposure,
+        ndarray::Array<double const,1,1> const & x,
+        ndarray::Array<double const,1,1> const & y,
+        ndarray::Array<double const,1,1> const & ixx,
+        ndarray::Array<double const,1,1> const & iyy,
+        ndarray::Array<double const,1,1> const & ixy,
+        ndarray::Array<double,1,1> const & flux,
+        ndarray::Array<double,1,1> const & fluxSigma,
+        ndarray::Array<double,1,1> const & radius,
+        ndarray::Array<int,1,1> const & flags
+    ) {
+    int const n = x.getSize<0>();
+    int const sizes[] = {y.getSize<0>(), ixx.getSize<0>(), iyy.getSize<0>(), ixy.getSize<0>(),
+                         flux.getSize<0>(), fluxSigma.getSize<0>(), radius.getSize<0>(), flags.getSize<0>()};
+    for (std::size_t i = 0; i != sizeof(sizes)/sizeof(sizes[0]); ++i) {
+        if (sizes[i] != n) {
+            throw LSST_EXCEPT(pex::exceptions::LengthError,
+                              (boost::format("All the arrays must have the same length: %d v. %d")
+                               % sizes[i] % n).str());
+        }
+    }
+    if (ctrl.useFootprintRadius) {
+        throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,
+                          "Sources measured from arrays have no Footprints, so can't set useFootprintRadius");
+    }
+    //
+    // The minimal schema that the algorithm needs: slots for the positions and shapes
+    //
+    afw::table::Schema schema = afw::table::SourceTable::makeMinimalSchema();
+    afw::table::Point2DKey const centroidKey =
+        afw::table::Point2DKey::addFields(schema, "centroid", "centre of source", "pixels");
+    schema.addField<afw::table::Flag>("centroid_flag", "centroid is bad");
+    afw::table::QuadrupoleKey const shapeKey =
+        afw::table::QuadrupoleKey::addFields(schema, "shape", "second moments of source");
+    afw::table::Key<afw::table::Flag> const shapeFlagKey =
+        schema.addField<afw::table::Flag>("shape_flag", "shape is bad");
+    schema.getAliasMap()->set("slot_Centroid", "centroid");
+    schema.getAliasMap()->set("slot_Shape", "shape");
+    KronFluxAlgorithm const algorithm(ctrl, "kron", schema);
+
+    afw::table::SourceCatalog catalog(schema);
+    catalog.reserve(n);
+    for (int i = 0; i != n; ++i) {
+        PTR(afw::table::SourceRecord) source = catalog.addNew();
+        source->set(centroidKey, afw::geom::Point2D(x[i], y[i]));
+        if (utils::isfinite(ixx[i]) && utils::isfinite(iyy[i]) && utils::isfinite(ixy[i])) {
+            source->set(shapeKey, afw::geom::ellipses::Quadrupole(ixx[i], iyy[i], ixy[i]));
+        } else {
+            source->set(shapeFlagKey, true);
+        }
+    }
+    algorithm.measureCatalog(catalog, exposure);
+
+    for (int i = 0; i != n; ++i) {
+        afw::table::SourceRecord const & source = catalog[i];
+        meas::base::FluxResult const result = algorithm._fluxResultKey.get(source);
+        flux[i] = result.flux;
+        fluxSigma[i] = result.fluxSigma;
+        radius[i] = source.get(algorithm._radiusKey);
+        int bits = 0;
+        for (int j = 0; j != N_FLAGS; ++j) {
+            if (algorithm._flagHandler.getValue(source, j)) {
+                bits |= (1 << j);
+            }
+        }
+        flags[i] = bits;
+    }
 }
 
 
-PTR(KronAperture) KronFluxAlgorithm::_fallbackRadius(afw::table::SourceRecord& source, double const R_K_psf,
-                                            pex::exceptions::Exception& exc) const
+KronAperture KronFluxAlgorithm::_fallbackRadius(afw::table::SourceRecord& source, double const R_K_psf,
+                                                pex::exceptions::Exception& exc) const
 {
     _flagHandler.setValue(source, BAD_RADIUS, true);
     double newRadius;
@@ -637,8 +3210,8 @@ PTR(KronAperture) KronFluxAlgorithm::_fallbackRadius(afw::table::SourceRecord& s
             NO_FALLBACK_RADIUS
         );
     }
-    PTR(KronAperture) aperture(new KronAperture(source));
-    aperture->getAxes().scale(newRadius/aperture->getAxes().getDeterminantRadius());
+    KronAperture aperture(source);
+    aperture.getAxes().scale(newRadius/aperture.getAxes().getDeterminantRadius());
     return aperture;
 }
 
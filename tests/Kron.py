@@ -31,11 +31,15 @@ or
 """
 
 import math
+import os
+import struct
+import tempfile
 import unittest
 
 import numpy as np
 import itertools
 import lsst.utils.tests as tests
+import lsst.pex.exceptions as pexExceptions
 import lsst.pex.logging as pexLogging
 import lsst.afw.detection as afwDetection
 import lsst.afw.geom as afwGeom
@@ -179,17 +183,122 @@ def measureForced(exposure, source, refWcs, msConfig):
     task.run(measCat, exposure, refCat, refWcs)
     return measCat[0]
 
+def makeField(width, height, galaxies):
+    """Make a fake image containing several galaxies
+
+    galaxies is a list of (flux, a, b, theta, xcen, ycen) tuples
+    """
+    exp = None
+    for flux, a, b, theta, xcen, ycen in galaxies:
+        gal = makeGalaxy(width, height, flux, a, b, theta, xcen=xcen, ycen=ycen)
+        if exp is None:
+            exp = gal
+        else:
+            image = exp.getMaskedImage().getImage()
+            image += gal.getMaskedImage().getImage()
+    return exp
+
+PREFIX = "ext_photometryKron_KronFlux"
+
+# The galaxies, (flux, a, b, theta, xcen, ycen), in the 200x200 field used by the catalog tests
+FIELD_GALAXIES = [(1e5, 3.0, 2.0, 20.0, 50.0, 50.0),
+                  (1e4, 2.0, 2.0, 0.0, 140.0, 60.0),
+                  (5e4, 5.0, 1.0, 45.0, 100.0, 150.0),
+                  (5e4, 4.0, 2.0, 60.0, 98.0, 60.0),   # straddles tiles in testMeasureCatalogFromFile
+                  (2e4, 1.0, 0.5, 70.0, 150.0, 110.0), # barely resolved
+                  (1e5, 3.0, 2.0, 20.0, 8.0, 190.0),   # at the edge of the image
+                  (5e4, 5.0, 1.0, 45.0, 195.0, 100.0), # at the edge of the image
+                  ]
+
+def getGalaxy(source, galaxies=FIELD_GALAXIES):
+    """Return the element of galaxies that source was detected from"""
+    bbox = source.getFootprint().getBBox()
+    return [g for g in galaxies if bbox.contains(afwGeom.Point2I(int(g[4]), int(g[5])))][0]
+
+def findSource(catalog, xcen, ycen):
+    """Return the source in catalog that was detected from the galaxy at (xcen, ycen)"""
+    point = afwGeom.Point2I(int(xcen), int(ycen))
+    return [s for s in catalog if s.getFootprint().getBBox().contains(point)][0]
+
+def makeKronConfig(forced=False, nIterForRadius=1, kfac=2.5, **kronFields):
+    """As makeMeasurementConfig, but also setting the Kron plugin's config fields given in kronFields"""
+    msConfig = makeMeasurementConfig(forced=forced, nIterForRadius=nIterForRadius, kfac=kfac)
+    for name, value in kronFields.iteritems():
+        setattr(msConfig.plugins[PREFIX], name, value)
+    return msConfig
+
+def measureFreeCatalog(exposure, msConfig):
+    """Unforced measurement of all the objects in an image; returns the catalog and the task"""
+    schema = afwTable.SourceTable.makeMinimalSchema()
+    task = measBase.SingleFrameMeasurementTask(schema, config=msConfig)
+    measCat = afwTable.SourceCatalog(schema)
+    ss = afwDetection.FootprintSet(exposure.getMaskedImage(), afwDetection.Threshold(0.1))
+    ss.makeSources(measCat)
+    task.run(measCat, exposure)
+    return measCat, task
+
+def measureForcedCatalog(exposure, refCat, msConfig):
+    """Forced measurement on exposure of all the objects in refCat; returns the catalog and the task"""
+    refWcs = exposure.getWcs()
+    schema = afwTable.SourceTable.makeMinimalSchema()
+    task = measBase.ForcedMeasurementTask(schema, config=msConfig)
+    measCat = task.generateMeasCat(exposure, refCat, refWcs)
+    task.attachTransformedFootprints(measCat, refCat, exposure, refWcs)
+    task.run(measCat, exposure, refCat, refWcs)
+    return measCat, task
+
+def resetKronFields(catalog, prefix="ext_photometryKron_KronFlux_"):
+    """Return a deep copy of catalog with all the Kron outputs reset"""
+    copy = afwTable.SourceCatalog(catalog.getTable().clone())
+    copy.extend(catalog, deep=True)
+    items = catalog.getSchema().extract(prefix + "*")
+    for record in copy:
+        for name, item in items.iteritems():
+            if item.field.getTypeString() == "Flag":
+                record.set(item.key, False)
+            elif item.field.getTypeString() in ("F", "D"):
+                record.set(item.key, float("nan"))
+    return copy
+
+def remeasure(algorithm, catalog, exposure):
+    """Return a copy of catalog with the Kron outputs reset and then remeasured by algorithm.measureCatalog"""
+    copy = resetKronFields(catalog)
+    algorithm.measureCatalog(copy, exposure)
+    return copy
+
+def compareKronFields(testCase, cat1, cat2, prefix="ext_photometryKron_KronFlux_"):
+    """Assert that the Kron outputs of two catalogs are identical"""
+    items = cat1.getSchema().extract(prefix + "*")
+    for rec1, rec2 in zip(cat1, cat2):
+        for name, item in items.iteritems():
+            v1, v2 = rec1.get(item.key), rec2.get(item.key)
+            if item.field.getTypeString() in ("F", "D") and np.isnan(v1):
+                testCase.assertTrue(np.isnan(v2), "%s: %s v. %s" % (name, v1, v2))
+            else:
+                testCase.assertEqual(v1, v2, "%s: %s v. %s" % (name, v1, v2))
+
 class KronPhotometryTestCase(tests.TestCase):
     """A test case for measuring Kron quantities"""
 
+    @classmethod
+    def setUpClass(cls):
+        # makeGalaxy is slow, so the field used by the catalog tests is only made once
+        cls.field = makeField(200, 200, FIELD_GALAXIES)
+
+    @classmethod
+    def tearDownClass(cls):
+        del cls.field
+
     def setUp(self):
         self.flux = 1e5
         self.width, self.height = 200, 200
         self.objImg = None
+        self.exposure = self.field.Factory(self.field, True) # a copy of the field that tests may modify
 
     def tearDown(self):
         if self.objImg:
             del self.objImg
+        del self.exposure
 
     def makeAndMeasure(self, measureKron, a, b, theta, dx=0.0, dy=0.0, nsigma=6, kfac=2, nIterForRadius=1,
                        xcen=None, ycen=None,
@@ -610,6 +719,515 @@ class KronPhotometryTestCase(tests.TestCase):
                                ])
                         raise
 
+    def testMeasureCatalog(self):
+        """Check that measuring a whole catalog at once (with and without threads and smoothing) is the
+        same as measuring one source at a time"""
+        for nThreads, smoothingSigma, cacheSmoothedImage in itertools.product((1, 3), (-1.0, 1.0),
+                                                                              (False, True)):
+            msConfig = makeKronConfig(nIterForRadius=2, nThreads=nThreads, smoothingSigma=smoothingSigma,
+                                      cacheSmoothedImage=cacheSmoothedImage,
+                                      smoothingTileSize=64, smoothingTileBudget=4)
+            measCat, task = measureFreeCatalog(self.exposure, msConfig)
+            self.assertGreater(len(measCat), 1)
+            compareKronFields(self, measCat, remeasure(task.plugins[PREFIX].cpp, measCat, self.exposure))
+
+    def testMeasureCatalogOrder(self):
+        """Check that the results of measureCatalog don't depend on the order of the catalog (the sources
+        are measured in spatial order)"""
+        measCat, task = measureFreeCatalog(self.exposure, makeKronConfig(nIterForRadius=2))
+        algorithm = task.plugins[PREFIX].cpp
+
+        batchCat = remeasure(algorithm, measCat, self.exposure)
+        reversedCat = afwTable.SourceCatalog(batchCat.getTable())
+        for source in reversed(measCat):
+            reversedCat.append(source)
+        reversedCat = remeasure(algorithm, reversedCat, self.exposure)
+        compareKronFields(self, batchCat, list(reversed(reversedCat)))
+
+    def testMeasureForcedCatalog(self):
+        """Check that forced measurement of a whole catalog at once is the same as measuring one source
+        at a time"""
+        refCat = measureFreeCatalog(self.exposure, makeKronConfig())[0]
+        measCat, task = measureForcedCatalog(self.exposure, refCat, makeKronConfig(forced=True))
+        self.assertGreater(len(measCat), 1)
+
+        batchCat = resetKronFields(measCat)
+        task.plugins[PREFIX].cpp.measureForcedCatalog(batchCat, self.exposure, refCat, self.exposure.getWcs())
+        compareKronFields(self, measCat, batchCat)
+
+    def testApertureStore(self):
+        """Check that forced measurement using a stored set of apertures is the same as using the reference
+        catalog"""
+        refCat, refTask = measureFreeCatalog(self.exposure, makeKronConfig())
+        measCat, task = measureForcedCatalog(self.exposure, refCat, makeKronConfig(forced=True))
+
+        fd, fileName = tempfile.mkstemp(suffix=".kron")
+        os.close(fd)
+        try:
+            refTask.plugins[PREFIX].cpp.writeApertures(refCat, fileName)
+            store = lsst.meas.extensions.photometryKron.KronApertureStore(fileName)
+            nGood = len([ref for ref in refCat if ref.get(PREFIX + "_radius") > 0])
+            self.assertGreater(nGood, 0)
+            self.assertEqual(store.size(), nGood)
+
+            storeCat = resetKronFields(measCat)
+            task.plugins[PREFIX].cpp.measureForcedFromStore(storeCat, self.exposure, store,
+                                                            self.exposure.getWcs())
+            for ref, forced, stored in zip(refCat, measCat, storeCat):
+                self.assertEqual(ref.getId(), stored.getId())
+                if store.find(ref.getId()) is None:
+                    self.assertTrue(stored.get(PREFIX + "_flag"))
+                    continue
+                if stored.get(PREFIX + "_flag"):  # radius_for_radius is only set for successful sources
+                    self.assertTrue(np.isnan(stored.get(PREFIX + "_radius_for_radius")))
+                else:
+                    self.assertEqual(stored.get(PREFIX + "_radius_for_radius"),
+                                     ref.get(PREFIX + "_radius_for_radius"))
+                for field in ("_flux", "_fluxSigma", "_radius"):
+                    self.assertClose(stored.get(PREFIX + field), forced.get(PREFIX + field), rtol=1e-6)
+                for field in ("_flag", "_flag_edge"):
+                    self.assertEqual(stored.get(PREFIX + field), forced.get(PREFIX + field))
+        finally:
+            os.remove(fileName)
+
+    def testApertureStoreCorrupt(self):
+        """Check that we reject a store whose number of entries doesn't match its size, even if the size of
+        the entries overflows"""
+        fd, fileName = tempfile.mkstemp(suffix=".kron")
+        try:
+            # A header with no entries following it; 2^61 56-byte entries is 7*2^64 bytes
+            os.write(fd, struct.pack("=8sq", "KRONAP01", 2**61))
+            os.close(fd)
+            self.assertRaises(pexExceptions.IoError,
+                              lsst.meas.extensions.photometryKron.KronApertureStore, fileName)
+        finally:
+            os.remove(fileName)
+
+    def testMeasureCatalogFromFile(self):
+        """Check that measuring an Exposure read from a file a tile at a time gives the same answers as
+        measuring the whole Exposure"""
+        fd, fileName = tempfile.mkstemp(suffix=".fits")
+        os.close(fd)
+        try:
+            self.exposure.writeFits(fileName)
+            for smoothingSigma in (-1.0, 1.0):
+                msConfig = makeKronConfig(nIterForRadius=2, smoothingSigma=smoothingSigma, collectStats=True)
+                measCat, task = measureFreeCatalog(self.exposure, msConfig)
+                algorithm = task.plugins[PREFIX].cpp
+                nEdge = algorithm.getStats().nEdge
+                self.assertEqual(nEdge, len([s for s in measCat if s.get(PREFIX + "_flag_edge")]))
+                for tileSize, tileMargin in [(64, 8), (100, 0), (1000, 0)]:
+                    tiledCat = resetKronFields(measCat)
+                    algorithm.resetStats()
+                    algorithm.measureCatalogFromFile(tiledCat, fileName, tileSize, tileMargin)
+                    compareKronFields(self, measCat, tiledCat)
+                    # Sources deferred to a larger region are only counted once
+                    self.assertEqual(algorithm.getStats().nEdge, nEdge)
+        finally:
+            os.remove(fileName)
+
+    def testMeasureChildren(self):
+        """Check that measuring children on their HeavyFootprints over noise agrees with measuring them on
+        the full image"""
+        measCat, task = measureFreeCatalog(self.exposure, makeKronConfig(nIterForRadius=2))
+        algorithm = task.plugins[PREFIX].cpp
+
+        childCat = resetKronFields(measCat)
+        for source in childCat[1:]:     # leave the first source as a parent
+            source.setFootprint(afwDetection.makeHeavyFootprint(source.getFootprint(),
+                                                                self.exposure.getMaskedImage()))
+        algorithm.measureChildren(childCat, self.exposure, 1)
+        compareKronFields(self, measCat[:1], childCat[:1])
+        for source, child in zip(measCat, childCat):
+            self.assertEqual(source.get(PREFIX + "_flag"), child.get(PREFIX + "_flag"))
+            if not source.get(PREFIX + "_flag"):
+                self.assertNotEqual(source.get(PREFIX + "_flux"), child.get(PREFIX + "_flux")) # noisy
+                self.assertClose(source.get(PREFIX + "_flux"), child.get(PREFIX + "_flux"), rtol=1e-2)
+                self.assertClose(source.get(PREFIX + "_radius"), child.get(PREFIX + "_radius"), rtol=1e-2)
+        # The noise is reproducible
+        againCat = resetKronFields(childCat)
+        algorithm.measureChildren(againCat, self.exposure, 1)
+        compareKronFields(self, childCat, againCat)
+
+    def testMeasureBands(self):
+        """Check that measuring several bands at once is the same as measuring each band in forced mode"""
+        refCat = measureFreeCatalog(self.exposure, makeKronConfig())[0]
+        # A second band, twice as bright
+        exposure2 = self.exposure.Factory(self.exposure, True)
+        exposure2.getMaskedImage().getImage().getArray()[:] *= 2
+
+        forcedCats, bandCats = [], lsst.meas.extensions.photometryKron.SourceCatalogVector()
+        exposures = lsst.meas.extensions.photometryKron.ExposureFConstPtrVector()
+        for exp in (self.exposure, exposure2):
+            measCat, task = measureForcedCatalog(exp, refCat, makeKronConfig(forced=True))
+            forcedCats.append(measCat)
+            bandCats.append(resetKronFields(measCat))
+            exposures.append(exp)
+
+        task.plugins[PREFIX].cpp.measureBands(bandCats, exposures, refCat, self.exposure.getWcs())
+        # The bands are pixel-aligned with the reference, so the apertures weren't transformed; the forced
+        # measurement linearises the (identity) transform between the Wcses, so isn't bit-for-bit the same
+        for forcedCat, bandCat in zip(forcedCats, bandCats):
+            for forced, band in zip(forcedCat, bandCat):
+                self.assertEqual(forced.get(PREFIX + "_flag"), band.get(PREFIX + "_flag"))
+                if not forced.get(PREFIX + "_flag"):
+                    for field in ("_radius", "_flux", "_fluxSigma"):
+                        self.assertClose(forced.get(PREFIX + field), band.get(PREFIX + field), rtol=1e-5)
+        for band1, band2 in zip(*list(bandCats)):
+            if not band1.get(PREFIX + "_flag"):
+                self.assertClose(2*band1.get(PREFIX + "_flux"), band2.get(PREFIX + "_flux"), rtol=1e-6)
+
+    def testMeasureArrays(self):
+        """Check that measuring arrays of positions and shapes is the same as measuring a catalog"""
+        msConfig = makeKronConfig(nIterForRadius=2)
+        measCat = measureFreeCatalog(self.exposure, msConfig)[0]
+        x = [source.getX() for source in measCat]
+        y = [source.getY() for source in measCat]
+        shapes = [source.getShape() for source in measCat]
+        ixx, iyy, ixy = [[getattr(q, "get" + m)() for q in shapes] for m in ("Ixx", "Iyy", "Ixy")]
+
+        flux, fluxSigma, radius, flags = lsst.meas.extensions.photometryKron.measureKronArrays(
+            self.exposure, x, y, ixx, iyy, ixy, msConfig.plugins[PREFIX].makeControl())
+        self.assertEqual(len(flux), len(measCat))
+        for i, source in enumerate(measCat):
+            self.assertEqual(bool(flags[i] & 0x1), source.get(PREFIX + "_flag"))
+            self.assertEqual(bool(flags[i] & 0x2), source.get(PREFIX + "_flag_edge"))
+            if source.get(PREFIX + "_flag"):
+                continue
+            self.assertClose(flux[i], source.get(PREFIX + "_flux"), rtol=1e-6)
+            self.assertClose(fluxSigma[i], source.get(PREFIX + "_fluxSigma"), rtol=1e-6)
+            self.assertClose(radius[i], source.get(PREFIX + "_radius"), rtol=1e-6)
+
+    def testMeasureCatalogDouble(self):
+        """Check that measuring an Exposure<double> gives the same answers as the same Exposure<float>"""
+        mimage = self.exposure.getMaskedImage()
+        image = afwImage.ImageD(mimage.getBBox(afwImage.PARENT))
+        image.getArray()[:] = mimage.getImage().getArray()
+        mimageD = afwImage.MaskedImageD(image, mimage.getMask(), mimage.getVariance())
+        exposureD = afwImage.makeExposure(mimageD, self.exposure.getWcs())
+        exposureD.setPsf(self.exposure.getPsf())
+
+        for smoothingSigma in (-1.0, 1.0):
+            msConfig = makeKronConfig(nIterForRadius=2, smoothingSigma=smoothingSigma)
+            measCat, task = measureFreeCatalog(self.exposure, msConfig)
+            catD = remeasure(task.plugins[PREFIX].cpp, measCat, exposureD)
+            for source, sourceD in zip(measCat, catD):
+                self.assertEqual(source.get(PREFIX + "_flag"), sourceD.get(PREFIX + "_flag"))
+                if source.get(PREFIX + "_flag_edge"):
+                    continue
+                for field in ("_radius", "_flux", "_fluxSigma"):
+                    self.assertClose(source.get(PREFIX + field), sourceD.get(PREFIX + field), rtol=1e-6)
+
+    def testRadiusTolerance(self):
+        """Check that we stop iterating for the Kron radius once it's converged"""
+        nIterForRadius = 5
+        results = []
+        for radiusTolerance in (0.0, 0.5):
+            msConfig = makeKronConfig(nIterForRadius=nIterForRadius, radiusTolerance=radiusTolerance,
+                                      collectStats=True)
+            measCat, task = measureFreeCatalog(self.exposure, msConfig)
+            nIter = [source.get(PREFIX + "_n_iter") for source in measCat]
+            self.assertEqual(task.plugins[PREFIX].cpp.getStats().nIter, sum(nIter))
+            results.append([(n, source.get(PREFIX + "_radius"))
+                            for n, source in zip(nIter, measCat) if not source.get(PREFIX + "_flag_edge")])
+        # The radius has converged to 50% after two iterations, so the second run stops there
+        self.assertLess(sum(n for n, radius in results[1]), sum(n for n, radius in results[0]))
+        for (nIter0, radius0), (nIter, radius) in zip(*results):
+            self.assertGreater(nIter0, 0)
+            self.assertLessEqual(nIter0, nIterForRadius)
+            self.assertGreater(nIter, 0)
+            self.assertLessEqual(nIter, min(nIter0, 2))
+            if nIter == nIter0:
+                self.assertEqual(radius, radius0)
+
+    def testIncrementalRadius(self):
+        """Check that summing only the annuli between successive radius apertures gives the same answer"""
+        for smoothingSigma in (-1.0, 1.0):
+            results = []
+            for incrementalRadius in (False, True):
+                msConfig = makeKronConfig(nIterForRadius=3, smoothingSigma=smoothingSigma,
+                                          incrementalRadius=incrementalRadius)
+                results.append(measureFreeCatalog(self.exposure, msConfig)[0])
+
+            nAnnulus = 0                # number of sources for which we summed an annulus
+            for source, incremental in zip(*results):
+                self.assertEqual(source.get(PREFIX + "_n_iter"), incremental.get(PREFIX + "_n_iter"))
+                if source.get(PREFIX + "_flag_edge"):
+                    continue
+                if incremental.get(PREFIX + "_n_iter") > 1:
+                    nAnnulus += 1
+                self.assertClose(source.get(PREFIX + "_radius"), incremental.get(PREFIX + "_radius"),
+                                 rtol=1e-10)
+                self.assertClose(source.get(PREFIX + "_flux"), incremental.get(PREFIX + "_flux"), rtol=1e-10)
+            self.assertGreater(nAnnulus, 0)
+
+    def testFloatRadiusMoments(self):
+        """Check that accumulating the radius moments in single precision gives (almost) the same answer"""
+        results = []
+        for floatRadiusMoments in (False, True):
+            msConfig = makeKronConfig(nIterForRadius=2, floatRadiusMoments=floatRadiusMoments)
+            results.append(measureFreeCatalog(self.exposure, msConfig)[0])
+
+        self.assertEqual(len(results[0]), len(FIELD_GALAXIES))
+        for source, single in zip(*results):
+            self.assertEqual(source.get(PREFIX + "_flag"), single.get(PREFIX + "_flag"))
+            if source.get(PREFIX + "_flag_edge"):
+                continue
+            flux, a, b, theta, x, y = getGalaxy(source)
+            R_K, R_single = source.get(PREFIX + "_radius"), single.get(PREFIX + "_radius")
+            self.assertLess(abs(R_K - R_single), 1e-2*self.getTolRad(a, b))
+            self.assertClose(R_K, R_single, rtol=1e-5)
+            flux_K, flux_single = source.get(PREFIX + "_flux"), single.get(PREFIX + "_flux")
+            self.assertLess(abs(flux_single/flux_K - 1), 1e-2*self.getTolFlux(a, b, 2.5))
+
+    def testRadiusErr(self):
+        """Check the error in the Kron radius"""
+        measCat, task = measureFreeCatalog(self.exposure, makeKronConfig(nIterForRadius=2))
+        # The error scales as the square root of the variance
+        self.exposure.getMaskedImage().getVariance().set(4.0)
+        noisyCat = remeasure(task.plugins[PREFIX].cpp, measCat, self.exposure)
+        nGood = 0
+        for source, noisy in zip(measCat, noisyCat):
+            if source.get(PREFIX + "_flag_edge"):
+                continue
+            nGood += 1
+            self.assertFalse(source.get(PREFIX + "_flag"))
+            self.assertGreater(source.get(PREFIX + "_radius_err"), 0)
+            self.assertLess(source.get(PREFIX + "_radius_err"), source.get(PREFIX + "_radius"))
+            self.assertEqual(source.get(PREFIX + "_radius"), noisy.get(PREFIX + "_radius"))
+            self.assertClose(2*source.get(PREFIX + "_radius_err"), noisy.get(PREFIX + "_radius_err"),
+                             rtol=1e-6)
+        self.assertGreater(nGood, 0)
+        # We don't know the error if we smooth the image
+        measCat = measureFreeCatalog(self.exposure, makeKronConfig(nIterForRadius=2, smoothingSigma=1.0))[0]
+        for source in measCat:
+            self.assertTrue(np.isnan(source.get(PREFIX + "_radius_err")))
+
+    def testBadMaskPlanes(self):
+        """Check that we can skip masked pixels while estimating the radius and summing the flux"""
+        # N.b. the sinc code doesn't skip masked pixels, so don't use it
+        msConfig = makeKronConfig(nIterForRadius=2, maxSincRadius=0.0)
+        cleanCat, task = measureFreeCatalog(self.exposure, msConfig)
+        for source in cleanCat:
+            self.assertFalse(source.get(PREFIX + "_flag_masked"))
+            self.assertTrue(np.isnan(source.get(PREFIX + "_masked_fraction")))
+        algorithm = task.plugins[PREFIX].cpp
+        msConfig.plugins[PREFIX].badMaskPlanes = ["CR"]
+        maskedAlgorithm = measureFreeCatalog(self.exposure, msConfig)[1].plugins[PREFIX].cpp
+        # add a masked cosmic ray within the Kron aperture of the galaxy at (50, 50), and remeasure using
+        # the clean shapes
+        image = self.exposure.getMaskedImage().getImage()
+        mask = self.exposure.getMaskedImage().getMask()
+        crBit = mask.getPlaneBitMask("CR")
+        for x, y in [(57, 50), (58, 50), (57, 51), (58, 51)]:
+            image.set(x, y, 1e4)
+            mask.set(x, y, crBit)
+
+        crCat = remeasure(algorithm, cleanCat, self.exposure)
+        self.assertGreater(findSource(crCat, 50, 50).get(PREFIX + "_flux"),
+                           findSource(cleanCat, 50, 50).get(PREFIX + "_flux") + 1e4)
+
+        maskedCat = remeasure(maskedAlgorithm, cleanCat, self.exposure)
+        crId = findSource(maskedCat, 50, 50).getId()
+        for masked, clean in zip(maskedCat, cleanCat):
+            self.assertEqual(masked.get(PREFIX + "_flag"), clean.get(PREFIX + "_flag"))
+            if clean.get(PREFIX + "_flag_edge"):
+                continue
+            if masked.getId() != crId:  # no pixels are masked, so nothing changes
+                self.assertFalse(masked.get(PREFIX + "_flag_masked"))
+                self.assertEqual(masked.get(PREFIX + "_masked_fraction"), 0.0)
+                for field in ("_flux", "_fluxSigma", "_radius"):
+                    self.assertEqual(masked.get(PREFIX + field), clean.get(PREFIX + field))
+                continue
+            self.assertFalse(masked.get(PREFIX + "_flag"))
+            self.assertTrue(masked.get(PREFIX + "_flag_masked"))
+            self.assertGreater(masked.get(PREFIX + "_masked_fraction"), 0.0)
+            self.assertLess(masked.get(PREFIX + "_masked_fraction"), 0.1)
+            self.assertClose(masked.get(PREFIX + "_flux"), clean.get(PREFIX + "_flux"), rtol=1e-2)
+            self.assertClose(masked.get(PREFIX + "_radius"), clean.get(PREFIX + "_radius"), rtol=2e-2)
+        # The masked pixels are counted in the same pass as the flux, whether or not the main aperture is
+        # measured along with extra apertures
+        msConfig.plugins[PREFIX].extraNRadiusForFlux = [1.0, 5.0]
+        extraAlgorithm = measureFreeCatalog(self.exposure, msConfig)[1].plugins[PREFIX].cpp
+        extraCat = remeasure(extraAlgorithm, cleanCat, self.exposure)
+        self.assertEqual(findSource(extraCat, 50, 50).get(PREFIX + "_masked_fraction"),
+                         findSource(maskedCat, 50, 50).get(PREFIX + "_masked_fraction"))
+
+    def testExtraApertures(self):
+        """Check that the fluxes in extra apertures (some measured with sinc apertures, some measured in
+        one pass) are the same as measuring each aperture separately"""
+        extraNRadiusForFlux = [1.0, 2.0, 3.5, 5.0]
+        measCat = measureFreeCatalog(self.exposure,
+                                     makeKronConfig(maxSincRadius=4.0,
+                                                    extraNRadiusForFlux=extraNRadiusForFlux))[0]
+
+        for nRadius in [2.5] + extraNRadiusForFlux:
+            singleCat = measureFreeCatalog(self.exposure, makeKronConfig(kfac=nRadius, maxSincRadius=4.0))[0]
+
+            name = PREFIX if nRadius == 2.5 else "%s_%s" % (PREFIX, ("%.1f" % nRadius).replace(".", "_"))
+            for source, single in zip(measCat, singleCat):
+                if source.get(PREFIX + "_flag_edge"):
+                    self.assertTrue(source.get(name + "_flag"))
+                    continue
+                self.assertEqual(source.get(PREFIX + "_radius"), single.get(PREFIX + "_radius"))
+                if name != PREFIX:
+                    self.assertFalse(source.get(name + "_flag"))
+                self.assertClose(source.get(name + "_flux"), single.get(PREFIX + "_flux"), rtol=1e-10)
+                self.assertClose(source.get(name + "_fluxSigma"), single.get(PREFIX + "_fluxSigma"),
+                                 rtol=1e-10)
+
+    def testExtraAperturesNames(self):
+        """Check that we reject extra apertures that would have the same fields as another aperture"""
+        for extraNRadiusForFlux in ([2.2, 2.25], [3.0, 3.0], [2.5]):
+            ctrl = makeKronConfig(extraNRadiusForFlux=extraNRadiusForFlux).plugins[PREFIX].makeControl()
+            schema = afwTable.SourceTable.makeMinimalSchema()
+            self.assertRaises(pexExceptions.InvalidParameterError,
+                              lsst.meas.extensions.photometryKron.KronFluxAlgorithm, ctrl, PREFIX, schema)
+
+    def testExtraAperturesEdge(self):
+        """Check that the extra apertures that fit within the image are kept when the main aperture doesn't"""
+        extraNRadiusForFlux = [1.0, 2.0]
+        goodCat = measureFreeCatalog(self.exposure,
+                                     makeKronConfig(extraNRadiusForFlux=extraNRadiusForFlux))[0]
+        # An aperture of 20 Kron radii around the galaxy at (50, 50) extends beyond the image
+        edgeCat = measureFreeCatalog(self.exposure,
+                                     makeKronConfig(kfac=20.0, extraNRadiusForFlux=extraNRadiusForFlux))[0]
+        good, edge = findSource(goodCat, 50, 50), findSource(edgeCat, 50, 50)
+        self.assertFalse(good.get(PREFIX + "_flag"))
+        self.assertTrue(edge.get(PREFIX + "_flag"))
+        self.assertTrue(edge.get(PREFIX + "_flag_edge"))
+        for nRadius in extraNRadiusForFlux:
+            name = "%s_%s" % (PREFIX, ("%.1f" % nRadius).replace(".", "_"))
+            self.assertFalse(edge.get(name + "_flag"))
+            self.assertEqual(edge.get(name + "_flux"), good.get(name + "_flux"))
+            self.assertEqual(edge.get(name + "_fluxSigma"), good.get(name + "_fluxSigma"))
+
+    def testSincCache(self):
+        """Check that caching the sinc coefficients for quantized shapes gives (almost) the same fluxes"""
+        measCat = measureFreeCatalog(self.exposure, makeKronConfig())[0]
+        cachedCat, task = measureFreeCatalog(self.exposure, makeKronConfig(sincCacheTolerance=1e-3))
+        nMeasured = len([source for source in cachedCat if np.isfinite(source.get(PREFIX + "_flux"))])
+        algorithm = task.plugins[PREFIX].cpp
+        stats = algorithm.getSincCacheStats()
+        self.assertEqual(stats.nHit + stats.nMiss, nMeasured)
+        self.assertEqual(stats.nEntry, stats.nMiss)
+        self.assertGreater(stats.nBytes, 0)
+
+        for source, cached in zip(measCat, cachedCat):
+            self.assertEqual(source.get(PREFIX + "_flag"), cached.get(PREFIX + "_flag"))
+            if not source.get(PREFIX + "_flag_edge"):
+                self.assertEqual(source.get(PREFIX + "_radius"), cached.get(PREFIX + "_radius"))
+                self.assertClose(source.get(PREFIX + "_flux"), cached.get(PREFIX + "_flux"), rtol=1e-2)
+        # Measuring the same sources again should only use the cache
+        remeasure(algorithm, cachedCat, self.exposure)
+        self.assertEqual(algorithm.getSincCacheStats().nHit, stats.nHit + nMeasured)
+        self.assertEqual(algorithm.getSincCacheStats().nMiss, stats.nMiss)
+
+    def testStats(self):
+        """Check that the statistics of the work done are collected when asked for"""
+        measCat, task = measureFreeCatalog(self.exposure, makeKronConfig())
+        self.assertEqual(task.plugins[PREFIX].cpp.getStats().nSource, 0)
+
+        measCat, task = measureFreeCatalog(self.exposure, makeKronConfig(collectStats=True, nThreads=2))
+        algorithm = task.plugins[PREFIX].cpp
+        stats = algorithm.getStats()
+        self.assertEqual(stats.nSource, len(measCat))
+        self.assertEqual(stats.nIter, sum(source.get(PREFIX + "_n_iter") for source in measCat))
+        self.assertGreater(stats.nSinc + stats.nNaive, 0)
+        for t in (stats.psfTime, stats.smoothingTime, stats.radiusTime, stats.sincTime, stats.naiveTime):
+            self.assertGreaterEqual(t, 0.0)
+
+        remeasure(algorithm, measCat, self.exposure)
+        self.assertEqual(algorithm.getStats().nSource, 2*len(measCat))
+        algorithm.resetStats()
+        self.assertEqual(algorithm.getStats().nSource, 0)
+
+    def testEdgeRejection(self):
+        """Check that sources whose apertures hit the edge of the image are flagged without being measured"""
+        measCat, task = measureFreeCatalog(self.exposure, makeKronConfig(collectStats=True))
+
+        nEdge = 0
+        for source in measCat:
+            if source.get(PREFIX + "_flag_edge"):
+                nEdge += 1
+                self.assertTrue(source.get(PREFIX + "_flag"))
+                self.assertEqual(source.get(PREFIX + "_n_iter"), 0)
+        self.assertGreater(nEdge, 0)
+        self.assertLess(nEdge, len(measCat))
+        stats = task.plugins[PREFIX].cpp.getStats()
+        self.assertEqual(stats.nEdge, nEdge)
+        # No moments were summed or fluxes measured for the sources at the edge
+        self.assertEqual(stats.nIter, sum(source.get(PREFIX + "_n_iter") for source in measCat))
+        self.assertEqual(stats.nSinc + stats.nNaive, len(measCat) - nEdge)
+
+    def testPsfRadiusGrid(self):
+        """Check that interpolating the PSF's Kron radius from a grid gives the right answer"""
+        results = []
+        for spacing in (0, 64):
+            measCat = measureFreeCatalog(self.exposure, makeKronConfig(psfRadiusGridSpacing=spacing))[0]
+            results.append([source.get(PREFIX + "_psf_radius") for source in measCat])
+        # The PSF is spatially constant, so interpolation should be exact
+        self.assertClose(np.array(results[0]), np.array(results[1]), rtol=1e-6)
+
+    def testPsfRadiusGridVarying(self):
+        """Check the interpolated Kron radius of a spatially varying PSF near the corners of the image, where
+        the grid's outermost nodes are; the PSF is only defined within the image"""
+        exposure = makeField(200, 200, [(1e4, 1.5, 1.5, 0.0, x, y) for x in (20, 180) for y in (20, 180)])
+        # A PSF whose width varies linearly across the image...
+        kernel = afwMath.AnalyticKernel(31, 31, afwMath.GaussianFunction2D(1.0, 1.0, 0.0),
+                                        afwMath.PolynomialFunction2D(1))
+        kernel.setSpatialParameters([[1.5, 5e-3, 5e-3], [1.5, 5e-3, 5e-3], [0.0, 0.0, 0.0]])
+        # ...that can't be evaluated outside the image, as it's the CoaddPsf of a single input
+        schema = afwTable.ExposureTable.makeMinimalSchema()
+        weightKey = schema.addField("weight", type="D", doc="coadd weight")
+        inputs = afwTable.ExposureCatalog(schema)
+        record = inputs.addNew()
+        record.setPsf(measAlg.KernelPsf(kernel))
+        record.setWcs(exposure.getWcs())
+        record.setBBox(exposure.getBBox())
+        record.set(weightKey, 1.0)
+        exposure.setPsf(measAlg.CoaddPsf(inputs, exposure.getWcs(), "weight"))
+
+        exactCat = measureFreeCatalog(exposure, makeKronConfig())[0]
+        self.assertEqual(len(exactCat), 4)
+        # With a spacing of 100 pixels a grid starting at 0 needs a node at 200, outside the image
+        for spacing in (64, 100, 1000):
+            gridCat = measureFreeCatalog(exposure, makeKronConfig(psfRadiusGridSpacing=spacing))[0]
+            for exact, grid in zip(exactCat, gridCat):
+                self.assertFalse(exact.get(PREFIX + "_flag"))
+                self.assertFalse(grid.get(PREFIX + "_flag"))
+                self.assertClose(exact.get(PREFIX + "_psf_radius"), grid.get(PREFIX + "_psf_radius"),
+                                 rtol=1e-2)
+
+    def testEllipseSpans(self):
+        """Check that the Kron code rasterises elliptical apertures as Footprint(Ellipse) does, including
+        apertures that are clipped by the image's bounding box"""
+        bbox = afwGeom.Box2I(afwGeom.Point2I(0, 0), afwGeom.Extent2I(60, 40))
+        rand = np.random.RandomState(12345)
+
+        def getPixels(footprint):
+            return set((x, span.getY()) for span in footprint.getSpans()
+                       for x in range(span.getX0(), span.getX1() + 1))
+
+        nClipped = 0
+        for a, axisRatio, theta in itertools.product((0.3, 1.0, 2.7, 10.0, 31.4), (1.0, 0.5, 0.1),
+                                                     (0.0, 20.0, 45.0, 90.0, 137.0)):
+            axes = afwEllipses.Axes(a, a*axisRatio, math.radians(theta))
+            for i in range(3):
+                center = afwGeom.Point2D(rand.uniform(-5, 65), rand.uniform(-5, 45))
+                ellipse = afwEllipses.Ellipse(axes, center)
+                pixels = getPixels(lsst.meas.extensions.photometryKron.makeEllipseFootprint(ellipse, bbox))
+                expected = getPixels(afwDetection.Footprint(ellipse, bbox))
+                if len(getPixels(afwDetection.Footprint(ellipse))) > len(expected):
+                    nClipped += 1
+                # The two may only disagree about pixels whose centres lie on the ellipse
+                c, s = math.cos(axes.getTheta()), math.sin(axes.getTheta())
+                for x, y in pixels ^ expected:
+                    dx, dy = x - center.getX(), y - center.getY()
+                    u, v = c*dx + s*dy, -s*dx + c*dy
+                    self.assertLess(abs((u/axes.getA())**2 + (v/axes.getB())**2 - 1.0), 1e-10,
+                                    "pixel (%d, %d) for %s" % (x, y, ellipse))
+        self.assertGreater(nClipped, 0)
 
 #-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 